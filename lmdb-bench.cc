@@ -0,0 +1,520 @@
+#include "lmdb-safe.hh"
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <new>
+#include <cstdlib>
+
+using namespace std;
+
+/* Micro benchmarks for lmdb-safe itself, as opposed to LMDB. Run as:
+   lmdb-bench <benchmark> [maxthreads]
+   The numbers are most interesting when compared between two builds. */
+
+// every operator new in this program, for the allocs benchmark. LMDB itself uses malloc, which is not counted.
+static atomic<uint64_t> s_allocs{0};
+
+void* operator new(size_t size)
+{
+  ++s_allocs;
+  if(void* ret = malloc(size ? size : 1))
+    return ret;
+  throw bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+static double now()
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// runs func(tid) on 'threads' threads for roughly 'seconds', returns total calls per second
+template<typename Func>
+static double runThreads(unsigned int threads, double seconds, Func func)
+{
+  atomic<bool> stop{false};
+  atomic<uint64_t> total{0};
+  vector<thread> workers;
+  double start = now();
+  for(unsigned int n = 0; n < threads; ++n) {
+    workers.emplace_back([&, n]() {
+        uint64_t count = 0;
+        while(!stop) {
+          func(n);
+          ++count;
+        }
+        total += count;
+      });
+  }
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop = true;
+  for(auto& t : workers)
+    t.join();
+  return total / (now() - start);
+}
+
+// how fast can many threads open and close RO transactions
+static void benchROTransactions(unsigned int maxthreads)
+{
+  unlink("./bench-rotxn");
+  MDBEnv env("./bench-rotxn", MDB_NOSUBDIR, 0600);
+  for(unsigned int threads = 1; threads <= maxthreads; threads *= 2) {
+    double rate = runThreads(threads, 1.0, [&env](unsigned int) {
+        auto txn = env.getROTransaction();
+      });
+    cout << threads << " threads: " << (uint64_t)rate << " RO transactions/s, "
+         << (uint64_t)(rate/threads) << " per thread" << endl;
+  }
+  unlink("./bench-rotxn");
+  unlink("./bench-rotxn-lock");
+}
+
+// a point lookup per RO transaction, with fresh transactions and with pooled ones
+static void benchROLookups(unsigned int maxthreads)
+{
+  unlink("./bench-lookup");
+  MDBEnv env("./bench-lookup", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 1000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, n, n);
+    txn->commit();
+  }
+
+  for(unsigned int threads = 1; threads <= maxthreads; threads *= 2) {
+    for(int pooled = 0; pooled < 2; ++pooled) {
+      double rate = runThreads(threads, 1.0, [&](unsigned int tid) {
+          static thread_local uint32_t key = tid * 7919;
+          key = (key + 104729) % keys;
+          auto txn = pooled ? env.getPooledROTransaction() : env.getROTransaction();
+          MDBOutVal val;
+          if(txn->get(dbi, key, val))
+            throw std::runtime_error("missing key");
+        });
+      cout << threads << " threads, " << (pooled ? "pooled" : "fresh ") << ": " << (uint64_t)rate << " lookups/s" << endl;
+    }
+  }
+  unlink("./bench-lookup");
+  unlink("./bench-lookup-lock");
+}
+
+/* The rolookup loop, and gets within one transaction, on a single thread.
+   Compare a build with LMDB_SAFE_METRICS=1 to one without, 'make bench-metrics'
+   runs both. */
+static void benchMetrics()
+{
+  unlink("./bench-metrics");
+  MDBEnv env("./bench-metrics", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 1000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, n, n);
+    txn->commit();
+  }
+
+  cout << "LMDB_SAFE_METRICS=" << LMDB_SAFE_METRICS << endl;
+  for(int round = 0; round < 3; ++round) {
+    double rate = runThreads(1, 1.0, [&](unsigned int) {
+        static thread_local uint32_t key = 0;
+        key = (key + 104729) % keys;
+        auto txn = env.getPooledROTransaction();
+        MDBOutVal val;
+        if(txn->get(dbi, key, val))
+          throw std::runtime_error("missing key");
+      });
+    cout << "  pooled transaction per lookup: " << (uint64_t)rate << " lookups/s" << endl;
+
+    auto txn = env.getROTransaction();
+    uint32_t key = 0;
+    rate = runThreads(1, 1.0, [&](unsigned int) {
+        key = (key + 104729) % keys;
+        MDBOutVal val;
+        if(txn->get(dbi, key, val))
+          throw std::runtime_error("missing key");
+      });
+    cout << "  one transaction:               " << (uint64_t)rate << " gets/s" << endl;
+  }
+  unlink("./bench-metrics");
+  unlink("./bench-metrics-lock");
+}
+
+// small writes from many threads, each in its own transaction, and through the group committer.
+// Leaves fsync on, since amortizing that is the point, so the numbers depend on the disk under ./
+// The goal is 10x the writes/s of separate transactions.
+static void benchGroupCommit(unsigned int maxthreads)
+{
+  unlink("./bench-group");
+  MDBEnv env("./bench-group", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+
+  for(unsigned int threads = 1; threads <= maxthreads; threads *= 2) {
+    double rates[2];
+    for(int grouped = 0; grouped < 2; ++grouped) {
+      double rate = runThreads(threads, 1.0, [&](unsigned int tid) {
+          static thread_local uint32_t counter;
+          uint64_t key = ((uint64_t)tid << 32) | ++counter;
+          if(grouped) {
+            MDBWriteBatch batch;
+            batch.put(dbi, key, key);
+            env.submit(std::move(batch)).get();
+          }
+          else {
+            auto txn = env.getRWTransaction();
+            txn->put(dbi, key, key);
+            txn->commit();
+          }
+        });
+      cout << threads << " threads, " << (grouped ? "grouped " : "separate") << ": " << (uint64_t)rate << " writes/s" << endl;
+      rates[grouped] = rate;
+    }
+    cout << threads << " threads, grouped/separate: " << rates[1] / rates[0] << "x" << endl;
+  }
+  unlink("./bench-group");
+  unlink("./bench-group-lock");
+}
+
+// small writes from many threads with each MDBDurability, in an MDB_NOSYNC environment
+static void benchDurability(unsigned int maxthreads)
+{
+  unlink("./bench-durable");
+  MDBEnv env("./bench-durable", MDB_NOSUBDIR | MDB_NOSYNC, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const char* names[] = {"sync         ", "async-durable", "fire&forget  "};
+
+  for(unsigned int threads = 1; threads <= maxthreads; threads *= 2) {
+    for(int level = 0; level < 3; ++level) {
+      double rate = runThreads(threads, 1.0, [&](unsigned int tid) {
+          static thread_local uint32_t counter;
+          uint64_t key = ((uint64_t)tid << 32) | (++counter % 1024); // we time commits, not a growing tree
+          auto txn = env.getRWTransaction();
+          txn->put(dbi, key, key);
+          txn->commit((MDBDurability)level).get();
+        });
+      cout << threads << " threads, " << names[level] << ": " << (uint64_t)rate << " commits/s" << endl;
+    }
+  }
+  unlink("./bench-durable");
+  unlink("./bench-durable-lock");
+}
+
+// inserts where half the keys are there already, as exceptions and as return codes
+static void benchDuplicateInserts()
+{
+  unlink("./bench-dupinsert");
+  MDBEnv env("./bench-dupinsert", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 1000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; n += 2)
+      txn->put(dbi, n, n);
+    txn->commit();
+  }
+
+  for(int tryput = 0; tryput < 2; ++tryput) {
+    auto txn = env.getRWTransaction();
+    uint64_t dups = 0;
+    double start = now();
+    for(uint32_t n = 0; n < keys; ++n) {
+      if(tryput) {
+        if(txn->insert(dbi, n, n) == MDB_KEYEXIST)
+          ++dups;
+      }
+      else {
+        try {
+          txn->put(dbi, n, n, MDB_NOOVERWRITE);
+        }
+        catch(const MDBException& e) {
+          if(e.getRC() != MDB_KEYEXIST)
+            throw;
+          ++dups;
+        }
+      }
+    }
+    double rate = keys / (now() - start);
+    cout << (tryput ? "insert    " : "put+catch ") << ": " << (uint64_t)rate << " inserts/s, "
+         << dups << " duplicates" << endl;
+    txn->abort();
+  }
+  unlink("./bench-dupinsert");
+  unlink("./bench-dupinsert-lock");
+}
+
+// walks a million DUPFIXED duplicates of one key, one by one and a page at a time
+static void benchDupScan()
+{
+  unlink("./bench-dupscan");
+  MDBEnv env("./bench-dupscan", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP);
+  const uint32_t ids = 1000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < ids; ++n)
+      txn->put(dbi, "key", n, MDB_APPENDDUP);
+    txn->commit();
+  }
+
+  auto txn = env.getROTransaction();
+  auto cursor = txn->getCursor(dbi);
+  for(int paged = 0; paged < 2; ++paged) {
+    uint64_t sum = 0, count = 0;
+    double start = now();
+    for(int round = 0; round < 10; ++round) {
+      if(paged) {
+        for(const auto& page : cursor.dupPages<uint32_t>("key")) {
+          for(auto id : page)
+            sum += id;
+          count += page.size();
+        }
+      }
+      else {
+        MDBOutVal key, val;
+        for(int rc = cursor.find("key", key, val); !rc; rc = cursor.nextprev(key, val, MDB_NEXT_DUP)) {
+          sum += val.get<uint32_t>();
+          ++count;
+        }
+      }
+    }
+    double rate = count / (now() - start);
+    cout << (paged ? "pages " : "single") << ": " << (uint64_t)rate << " ids/s (sum " << sum << ")" << endl;
+  }
+  unlink("./bench-dupscan");
+  unlink("./bench-dupscan-lock");
+}
+
+// full and bounded scans, by hand, through the scan ranges, which should be just as fast, and in batches
+static void benchScan()
+{
+  unlink("./bench-scan");
+  MDBEnv env("./bench-scan", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 4000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, MDBOrdered<uint32_t>(n), n, MDB_APPEND);
+    txn->commit();
+  }
+
+  auto txn = env.getROTransaction();
+  auto cursor = txn->getCursor(dbi);
+  MDBInVal loval(MDBOrdered<uint32_t>(keys / 4)), hival(MDBOrdered<uint32_t>(keys / 2));
+  string_view lo((char*)loval.d_mdbval.mv_data, 4), hi((char*)hival.d_mdbval.mv_data, 4);
+
+  for(int bounded = 0; bounded < 2; ++bounded) {
+    for(int how = 0; how < 3; ++how) {
+      if(bounded && how == 2) // batches have no bounds
+        break;
+      uint64_t bytes = 0, count = 0;
+      double start = now();
+      for(int round = 0; round < 5; ++round) {
+        if(how == 1) {
+          for(const auto& kv : bounded ? cursor.scan(lo, hi) : cursor.scan()) {
+            bytes += kv.first.size() + kv.second.size();
+            ++count;
+          }
+        }
+        else if(how == 2) {
+          string_view ks[256], vs[256];
+          MDBOutVal key, val;
+          cursor.first(key, val);
+          bytes += key.d_mdbval.mv_size + val.d_mdbval.mv_size;
+          ++count;
+          while(size_t got = cursor.scanBatch(256, ks, vs)) {
+            for(size_t n = 0; n < got; ++n)
+              bytes += ks[n].size() + vs[n].size();
+            count += got;
+          }
+        }
+        else {
+          MDBOutVal key, val;
+          int rc = bounded ? cursor.lower_bound(loval, key, val) : cursor.first(key, val);
+          for(; !rc; rc = cursor.next(key, val)) {
+            if(bounded && memcmp(key.d_mdbval.mv_data, hi.data(), 4) >= 0)
+              break;
+            bytes += key.d_mdbval.mv_size + val.d_mdbval.mv_size;
+            ++count;
+          }
+        }
+      }
+      double rate = count / (now() - start);
+      const char* names[] = {"by hand    ", "scan()     ", "scanBatch()"};
+      cout << (bounded ? "bounded, " : "full,    ") << names[how] << ": "
+           << (uint64_t)rate << " rows/s (" << bytes << " bytes)" << endl;
+    }
+  }
+  unlink("./bench-scan");
+  unlink("./bench-scan-lock");
+}
+
+// batches of lookups of keys that are near each other, with get() and getMany()
+static void benchGetMany()
+{
+  unlink("./bench-getmany");
+  MDBEnv env("./bench-getmany", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 4000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, MDBOrdered<uint32_t>(n), n, MDB_APPEND);
+    txn->commit();
+  }
+
+  // 1000 keys in a window of 3000, in random order
+  std::vector<uint32_t> batch;
+  for(uint32_t n = 0; n < 1000; ++n)
+    batch.push_back(htonl(keys / 2 + (n * 7919) % 3000));
+  std::vector<string_view> wanted;
+  for(const auto& k : batch)
+    wanted.emplace_back((const char*)&k, sizeof(k));
+
+  auto txn = env.getROTransaction();
+  for(int many = 0; many < 2; ++many) {
+    uint64_t found = 0;
+    std::vector<string_view> vals;
+    double start = now();
+    for(int round = 0; round < 1000; ++round) {
+      if(many)
+        found += txn->getMany(dbi, wanted, vals);
+      else {
+        for(const auto& k : wanted) {
+          string_view val;
+          if(!txn->get(dbi, k, val))
+            ++found;
+        }
+      }
+    }
+    double rate = found / (now() - start);
+    cout << (many ? "getMany(): " : "get():     ") << (uint64_t)rate << " lookups/s" << endl;
+  }
+  unlink("./bench-getmany");
+  unlink("./bench-getmany-lock");
+}
+
+// allocations per lookup, with transactions on the heap and on the stack
+static void benchAllocs()
+{
+  unlink("./bench-allocs");
+  MDBEnv env("./bench-allocs", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 100000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, n, n);
+    txn->commit();
+  }
+
+  const char* names[] = {"getROTransaction()", "getPooledROTransaction()", "beginRO()", "beginPooledRO()"};
+  for(int kind = 0; kind < 4; ++kind) {
+    const uint32_t lookups = 1000000;
+    uint64_t allocs = s_allocs;
+    double start = now();
+    for(uint32_t n = 0; n < lookups; ++n) {
+      uint32_t key = (n * 104729) % keys;
+      MDBOutVal val;
+      int rc;
+      switch(kind) {
+      case 0:
+        rc = env.getROTransaction()->get(dbi, key, val);
+        break;
+      case 1:
+        rc = env.getPooledROTransaction()->get(dbi, key, val);
+        break;
+      case 2:
+        rc = env.beginRO().get(dbi, key, val);
+        break;
+      default:
+        rc = env.beginPooledRO().get(dbi, key, val);
+      }
+      if(rc)
+        throw std::runtime_error("missing key");
+    }
+    double rate = lookups / (now() - start);
+    cout << names[kind] << ": " << (double)(s_allocs - allocs) / lookups << " allocations/lookup, "
+         << (uint64_t)rate << " lookups/s" << endl;
+  }
+  unlink("./bench-allocs");
+  unlink("./bench-allocs-lock");
+}
+
+// a full scan of a cached database, on more and more threads
+static void benchParallelScan(unsigned int maxthreads)
+{
+  unlink("./bench-pscan");
+  MDBEnv env("./bench-pscan", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+  const uint32_t keys = 4000000;
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < keys; ++n)
+      txn->put(dbi, MDBOrdered<uint32_t>(n), n, MDB_APPEND);
+    txn->commit();
+  }
+
+  for(unsigned int threads = 1; threads <= maxthreads; threads *= 2) {
+    atomic<uint64_t> count{0};
+    double start = now();
+    for(int round = 0; round < 5; ++round) {
+      env.parallelScan(dbi, threads, [&count](unsigned int, MDBROCursor& cursor, string_view lo, string_view hi) {
+          uint64_t mine = 0;
+          for(const auto& kv : cursor.scan(lo, hi))
+            mine += kv.second.size() / 4;
+          count += mine;
+        });
+    }
+    double rate = count / (now() - start);
+    cout << threads << " threads: " << (uint64_t)rate << " rows/s" << endl;
+  }
+  unlink("./bench-pscan");
+  unlink("./bench-pscan-lock");
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2) {
+    cerr << "Syntax: lmdb-bench rotxn|rolookup|groupcommit|durability|dupinsert|dupscan|scan|parallelscan|getmany|allocs|metrics [maxthreads]" << endl;
+    return EXIT_FAILURE;
+  }
+  string bench = argv[1];
+  unsigned int maxthreads = argc > 2 ? atoi(argv[2]) : 64;
+
+  if(bench == "rotxn")
+    benchROTransactions(maxthreads);
+  else if(bench == "rolookup")
+    benchROLookups(maxthreads);
+  else if(bench == "groupcommit")
+    benchGroupCommit(maxthreads);
+  else if(bench == "durability")
+    benchDurability(maxthreads);
+  else if(bench == "dupinsert")
+    benchDuplicateInserts();
+  else if(bench == "dupscan")
+    benchDupScan();
+  else if(bench == "scan")
+    benchScan();
+  else if(bench == "parallelscan")
+    benchParallelScan(maxthreads);
+  else if(bench == "getmany")
+    benchGetMany();
+  else if(bench == "allocs")
+    benchAllocs();
+  else if(bench == "metrics")
+    benchMetrics();
+  else {
+    cerr << "Unknown benchmark '" << bench << "'" << endl;
+    return EXIT_FAILURE;
+  }
+}
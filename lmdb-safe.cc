@@ -3,8 +3,12 @@
 #include <mutex>
 #include <memory>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <string.h>
 #include <map>
+#include <atomic>
+#include <deque>
 
 using namespace std;
 
@@ -13,6 +17,11 @@ static string MDBError(int rc)
   return mdb_strerror(rc);
 }
 
+void throwMDBException(const char* what, int rc)
+{
+  throw MDBException(what, rc);
+}
+
 MDBDbi::MDBDbi(MDB_env* env, MDB_txn* txn, const string_view dbname, int flags)
 {
   // A transaction that uses this function must finish (either commit or abort) before any other transaction in the process may use this function.
@@ -24,16 +33,33 @@ MDBDbi::MDBDbi(MDB_env* env, MDB_txn* txn, const string_view dbname, int flags)
   // Database names are keys in the unnamed database, and may be read but not written.
 }
 
-MDBEnv::MDBEnv(const char* fname, int flags, int mode)
+static std::atomic<uint64_t> s_envids{0};
+
+MDBEnv::MDBEnv(const char* fname, int flags, int mode, const MDBEnvOptions& options) : d_id(++s_envids), d_hotPageFile(options.d_hotPageFile)
 {
   mdb_env_create(&d_env);   
-  if(mdb_env_set_mapsize(d_env, 16ULL*4096*244140ULL)) // 4GB
-    throw std::runtime_error("setting map size");
-    /*
-Various other options may also need to be set before opening the handle, e.g. mdb_env_set_mapsize(), mdb_env_set_maxreaders(), mdb_env_set_maxdbs(),
-    */
+  // Various options need to be set before opening the handle
+  if(int rc = mdb_env_set_mapsize(d_env, options.d_mapsize)) {
+    mdb_env_close(d_env);
+    throw std::runtime_error("setting map size: " + MDBError(rc));
+  }
+
+  if(int rc = mdb_env_set_maxdbs(d_env, options.d_maxdbs)) {
+    mdb_env_close(d_env);
+    throw std::runtime_error("setting maximum number of databases: " + MDBError(rc));
+  }
+
+  if(options.d_maxreaders) {
+    if(int rc = mdb_env_set_maxreaders(d_env, options.d_maxreaders)) {
+      mdb_env_close(d_env);
+      throw std::runtime_error("setting maximum number of readers: " + MDBError(rc));
+    }
+  }
 
-  mdb_env_set_maxdbs(d_env, 128);
+  if(!options.d_readahead)
+    flags |= MDB_NORDAHEAD;
+  if(options.d_writemap)
+    flags |= MDB_WRITEMAP;
 
   // we need MDB_NOTLS since we rely on its semantics
   if(int rc=mdb_env_open(d_env, fname, flags | MDB_NOTLS, mode)) {
@@ -41,50 +67,377 @@ Various other options may also need to be set before opening the handle, e.g. md
     mdb_env_close(d_env);
     throw std::runtime_error("Unable to open database file "+std::string(fname)+": " + MDBError(rc));
   }
+
+  if(!d_hotPageFile.empty() && options.d_hotPageThreads) {
+    unsigned int threads = options.d_hotPageThreads;
+    try {
+      d_hotPageRestore = std::async(std::launch::async, [this, threads]() { return restoreHotPages(d_hotPageFile, threads); });
+    }
+    catch(...) {
+      // no thread for it, which only means a colder cache
+    }
+  }
+}
+
+MDBEnv::~MDBEnv()
+{
+  d_closing = true;
+  if(d_hotPageRestore.valid())
+    d_hotPageRestore.wait();
+  d_committer.reset(); // commits what is still queued
+  d_syncer.reset(); // syncs what is not on disk yet
+  d_watchdog.reset();
+  trimROPool(true);
+  if(!d_hotPageFile.empty()) {
+    try {
+      saveHotPages(d_hotPageFile);
+    }
+    catch(...) {
+      // nothing to report it to from a destructor, and the next start just has a colder cache
+    }
+  }
+  //    Only a single thread may call this function. All transactions, databases, and cursors must already be closed before calling this function
+  mdb_env_close(d_env);
+  // but, elsewhere, docs say database handles do not need to be closed?
+}
+
+namespace {
+// the slots this thread holds, keyed on MDBEnv::d_id. Usually just one or two, so a vector beats a map
+struct ThreadSlots
+{
+  std::vector<std::pair<uint64_t, std::shared_ptr<MDBThreadSlot>>> d_slots;
+
+  ~ThreadSlots()
+  {
+    for(auto& s : d_slots) {
+      {
+        // if the MDBEnv is gone, it closed this transaction already
+        std::lock_guard<std::mutex> l(s.second->d_poolmut);
+        if(s.second->d_idle) {
+          mdb_txn_abort(s.second->d_idle);
+          s.second->d_idle = nullptr;
+        }
+        // RO cursors can be closed without their transaction or environment
+        for(auto& c : s.second->d_cursors)
+          mdb_cursor_close(c);
+        s.second->d_cursors.clear();
+      }
+      s.second->d_inuse = false;  // the MDBEnv can now hand this slot to another thread
+    }
+  }
+};
+
+thread_local ThreadSlots t_slots;
+}
+
+MDBThreadSlot& MDBEnv::getSlot()
+{
+  for(auto& s : t_slots.d_slots) {
+    if(s.first == d_id)
+      return *s.second;
+  }
+  return getSlotSlow();
+}
+
+MDBThreadSlot& MDBEnv::getSlotSlow()
+{
+  auto& ours = t_slots.d_slots;
+  // if we hold the only reference, the MDBEnv that slot belonged to is gone
+  ours.erase(std::remove_if(ours.begin(), ours.end(),
+                            [](const std::pair<uint64_t, std::shared_ptr<MDBThreadSlot>>& s) {
+                              return s.second.use_count() == 1;
+                            }), ours.end());
+
+  std::shared_ptr<MDBThreadSlot> slot;
+  {
+    std::lock_guard<std::mutex> l(d_slotmut);
+    for(auto& s : d_slots) {
+      if(!s->d_inuse) {
+        slot = s;
+        // a transaction may have been closed by another thread than the one that opened it
+        d_orphanRW += slot->d_rw.exchange(0);
+        d_orphanRO += slot->d_ro.exchange(0);
+        slot->d_inuse = true;
+        break;
+      }
+    }
+    if(!slot) {
+      slot = std::make_shared<MDBThreadSlot>();
+      d_slots.push_back(slot);
+    }
+  }
+  ours.emplace_back(d_id, slot);
+  return *slot;
+}
+
+/* Resizing the map needs all transactions in the process to be closed. While
+   growMap() waits for that, threads that start their first transaction wait
+   for growMap(). They first count their transaction and then check
+   d_resizing, while growMap() first sets d_resizing and then checks the
+   counts, so at least one of the two sees the other. */
+void MDBEnv::waitForResize(MDBThreadSlot& slot, std::atomic<int>& counter)
+{
+  while(d_resizing) {
+    if(slot.d_ro + slot.d_rw > 1) // we already hold a transaction, so the resize has to wait for us anyhow
+      return;
+    --counter;
+    {
+      std::unique_lock<std::mutex> l(d_resizemut);
+      d_resizecv.wait(l, [this]() { return !d_resizing; });
+    }
+    ++counter;
+  }
+}
+
+int MDBEnv::countTransactionsOut()
+{
+  std::lock_guard<std::mutex> l(d_slotmut);
+  int ret = d_orphanRO + d_orphanRW + d_snapshots;
+  for(auto& slot : d_slots)
+    ret += slot->d_ro + slot->d_rw;
+  return ret;
+}
+
+size_t MDBEnv::getMapSize()
+{
+  MDB_envinfo info;
+  if(int rc = mdb_env_info(d_env, &info))
+    throw MDBException("getting environment info", rc);
+  return info.me_mapsize;
+}
+
+bool MDBEnv::growMap(size_t seen)
+{
+  if(getROTX() || getRWTX())
+    return false;
+
+  std::lock_guard<std::mutex> l(d_growmut);
+  size_t current = getMapSize();
+  if(current > seen) // somebody beat us to it
+    return true;
+
+  size_t wanted = current;
+  if(d_growth.d_mode == MDBGrowthPolicy::Mode::Geometric)
+    wanted = current * d_growth.d_factor;
+  else if(d_growth.d_mode == MDBGrowthPolicy::Mode::FixedStep)
+    wanted = current + d_growth.d_step;
+  if(d_growth.d_ceiling && wanted > d_growth.d_ceiling)
+    wanted = d_growth.d_ceiling;
+  const size_t mb = 1024*1024;
+  wanted = (wanted + mb - 1) / mb * mb;
+  if(wanted <= current)
+    return false;
+
+  d_resizing = true;
+  auto deadline = std::chrono::steady_clock::now() + d_growth.d_quiesceTimeout;
+  while(countTransactionsOut() && std::chrono::steady_clock::now() < deadline)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  int rc = -1;
+  if(!countTransactionsOut())
+    rc = mdb_env_set_mapsize(d_env, wanted);
+
+  {
+    std::lock_guard<std::mutex> l2(d_resizemut);
+    d_resizing = false;
+  }
+  d_resizecv.notify_all();
+
+  if(rc > 0)
+    throw MDBException("growing map", rc);
+  return !rc;
 }
 
 void MDBEnv::incROTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  ++d_ROtransactionsOut[std::this_thread::get_id()];
+  auto& slot = getSlot();
+  ++slot.d_ro;
+  if(d_resizing)
+    waitForResize(slot, slot.d_ro);
 }
 
 void MDBEnv::decROTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  --d_ROtransactionsOut[std::this_thread::get_id()];
+  --getSlot().d_ro;
 }
 
 void MDBEnv::incRWTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  ++d_RWtransactionsOut[std::this_thread::get_id()];
+  auto& slot = getSlot();
+  ++slot.d_rw;
+  if(d_resizing)
+    waitForResize(slot, slot.d_rw);
 }
 
 void MDBEnv::decRWTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  --d_RWtransactionsOut[std::this_thread::get_id()];
+  --getSlot().d_rw;
+}
+
+MDB_txn* MDBEnv::takePooledROTransaction()
+{
+  if(getRWTX())
+    throw std::runtime_error("Duplicate RO transaction");
+
+  auto& slot = getSlot();
+  MDB_txn* txn;
+  std::chrono::steady_clock::time_point since;
+  {
+    std::lock_guard<std::mutex> l(slot.d_poolmut);
+    txn = slot.d_idle;
+    since = slot.d_idleSince;
+    slot.d_idle = nullptr;
+  }
+
+  if(txn && std::chrono::steady_clock::now() - since > std::chrono::milliseconds(d_poolIdleTimeout)) {
+    mdb_txn_abort(txn);
+    readerSlotFreed();
+    txn = nullptr;
+  }
+  if(txn) {
+    MDBOpTimer timer(threadMetrics(), MDBOp::BeginRO);
+    incROTX();
+    if(mdb_txn_renew(txn)) {
+      // for example MDB_MAP_RESIZED, which openROTransaction knows how to deal with
+      decROTX();
+      mdb_txn_abort(txn);
+      readerSlotFreed();
+      txn = nullptr;
+    }
+    else
+      timer.done(0);
+  }
+  if(!txn)
+    txn = MDBROTransactionImpl::openROTransaction(this, nullptr);
+  return txn;
+}
+
+MDBROTransaction MDBEnv::getPooledROTransaction(const char* site)
+{
+  MDBROTransaction ret(new MDBROTransactionImpl(this, takePooledROTransaction()));
+  ret->d_pooled = true;
+  if(d_watchReaders)
+    watchReader(*ret, site);
+  return ret;
+}
+
+MDBROTransactionImpl MDBEnv::beginPooledRO(const char* site)
+{
+  MDBROTransactionImpl ret(this, takePooledROTransaction());
+  ret.d_pooled = true;
+  if(d_watchReaders)
+    watchReader(ret, site);
+  return ret;
+}
+
+void MDBEnv::returnPooledROTransaction(MDB_txn* txn)
+{
+  mdb_txn_reset(txn);
+
+  auto now = std::chrono::steady_clock::now();
+  auto& slot = getSlot();
+  {
+    std::lock_guard<std::mutex> l(slot.d_poolmut);
+    if(!slot.d_idle) {
+      slot.d_idle = txn;
+      slot.d_idleSince = now;
+      txn = nullptr;
+    }
+  }
+  if(txn) { // we already had one
+    mdb_txn_abort(txn);
+    readerSlotFreed();
+  }
+
+  // every once in a while, whoever comes by first cleans up after the threads that went quiet
+  int64_t next = d_nextPoolTrim;
+  if(now.time_since_epoch().count() > next) {
+    int64_t then = (now + std::chrono::milliseconds(d_poolIdleTimeout)).time_since_epoch().count();
+    if(d_nextPoolTrim.compare_exchange_strong(next, then))
+      trimROPool();
+  }
+}
+
+void MDBEnv::trimROPool(bool all)
+{
+  trimIdleROTransactions(all);
+  if(!all)
+    return;
+  std::lock_guard<std::mutex> l(d_slotmut);
+  for(auto& slot : d_slots) {
+    std::lock_guard<std::mutex> l2(slot->d_poolmut);
+    for(auto& c : slot->d_cursors)
+      mdb_cursor_close(c);
+    slot->d_cursors.clear();
+  }
+}
+
+// only the transactions hold reader slots, the cached cursors stay
+void MDBEnv::trimIdleROTransactions(bool all)
+{
+  auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(d_poolIdleTimeout);
+  bool freed = false;
+  {
+    std::lock_guard<std::mutex> l(d_slotmut);
+    for(auto& slot : d_slots) {
+      std::lock_guard<std::mutex> l2(slot->d_poolmut);
+      if(slot->d_idle && (all || slot->d_idleSince < cutoff)) {
+        mdb_txn_abort(slot->d_idle);
+        slot->d_idle = nullptr;
+        freed = true;
+      }
+    }
+  }
+  if(freed)
+    readerSlotFreed();
+}
+
+MDB_cursor* MDBEnv::takeROCursor(MDB_dbi dbi)
+{
+  auto& slot = getSlot();
+  std::lock_guard<std::mutex> l(slot.d_poolmut);
+  auto& cursors = slot.d_cursors;
+  for(auto iter = cursors.rbegin(); iter != cursors.rend(); ++iter) {
+    if(mdb_cursor_dbi(*iter) == dbi) {
+      MDB_cursor* ret = *iter;
+      *iter = cursors.back();
+      cursors.pop_back();
+      return ret;
+    }
+  }
+  return nullptr;
+}
+
+void MDBEnv::recycleROCursor(MDB_cursor* cursor)
+{
+  auto& slot = getSlot();
+  {
+    std::lock_guard<std::mutex> l(slot.d_poolmut);
+    if(slot.d_cursors.size() < MDBThreadSlot::s_maxcursors) {
+      slot.d_cursors.push_back(cursor);
+      return;
+    }
+  }
+  mdb_cursor_close(cursor);
 }
 
 int MDBEnv::getRWTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  return d_RWtransactionsOut[std::this_thread::get_id()];
+  return getSlot().d_rw;
 }
 int MDBEnv::getROTX()
 {
-  std::lock_guard<std::mutex> l(d_countmutex);
-  return d_ROtransactionsOut[std::this_thread::get_id()];
+  return getSlot().d_ro;
 }
 
 
-std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode)
+std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode, const MDBEnvOptions& options)
 {
   struct Value
   {
     weak_ptr<MDBEnv> wp;
     int flags;
+    MDBEnvOptions options;
   };
   
   static std::map<tuple<dev_t, ino_t>, Value> s_envs;
@@ -96,11 +449,11 @@ std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode)
       throw std::runtime_error("Unable to stat prospective mdb database: "+string(strerror(errno)));
     else {
       std::lock_guard<std::mutex> l(mut);
-      auto fresh = std::make_shared<MDBEnv>(fname, flags, mode);
+      auto fresh = std::make_shared<MDBEnv>(fname, flags, mode, options);
       if(stat(fname, &statbuf))
         throw std::runtime_error("Unable to stat prospective mdb database: "+string(strerror(errno)));
       auto key = std::tie(statbuf.st_dev, statbuf.st_ino);
-      s_envs[key] = {fresh, flags};
+      s_envs[key] = {fresh, flags, options};
       return fresh;
     }
   }
@@ -113,6 +466,8 @@ std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode)
     if(sp) {
       if(iter->second.flags != flags)
         throw std::runtime_error("Can't open mdb with differing flags");
+      if(iter->second.options != options)
+        throw std::runtime_error("Can't open mdb with differing options");
 
       return sp;
     }
@@ -121,8 +476,8 @@ std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode)
     }
   }
 
-  auto fresh = std::make_shared<MDBEnv>(fname, flags, mode);
-  s_envs[key] = {fresh, flags};
+  auto fresh = std::make_shared<MDBEnv>(fname, flags, mode, options);
+  s_envs[key] = {fresh, flags, options};
   
   return fresh;
 }
@@ -138,7 +493,7 @@ MDBDbi MDBEnv::openDB(const string_view dbname, int flags)
   std::lock_guard<std::mutex> l(d_openmut);
   
   if(!(envflags & MDB_RDONLY)) {
-    auto rwt = getRWTransaction();
+    auto rwt = getRWTransaction("MDBEnv::openDB");
     MDBDbi ret = rwt->openDB(dbname, flags);
     rwt->commit();
     return ret;
@@ -156,7 +511,40 @@ MDBRWTransactionImpl::MDBRWTransactionImpl(MDBEnv *parent, MDB_txn *txn):
   MDBROTransactionImpl(parent, txn)
 
 {
+  // mdb_cursor_renew() only works on cursors of read-only transactions
+  d_cursors.d_recycler = nullptr;
+  d_rw_cursors.d_metrics = d_cursors.d_metrics;
+  d_rw = true;
+}
+
+MDBRWTransactionImpl::MDBRWTransactionImpl(MDBRWTransactionImpl&& rhs)
+{
+  takeFrom(rhs);
+  d_rw_cursors.take(rhs.d_rw_cursors);
+  ++rhs.d_rw_cursors.d_writes; // so reservations made through rhs are no longer valid
+  d_child = rhs.d_child;
+  d_profiled = rhs.d_profiled;
+  d_site = rhs.d_site;
+  d_wait = rhs.d_wait;
+  d_locked = rhs.d_locked;
+  rhs.d_profiled = false;
+}
 
+MDBRWTransactionImpl& MDBRWTransactionImpl::operator=(MDBRWTransactionImpl&& rhs)
+{
+  if(this != &rhs) {
+    abort();
+    takeFrom(rhs);
+    d_rw_cursors.take(rhs.d_rw_cursors);
+    ++rhs.d_rw_cursors.d_writes;
+    d_child = rhs.d_child;
+    d_profiled = rhs.d_profiled;
+    d_site = rhs.d_site;
+    d_wait = rhs.d_wait;
+    d_locked = rhs.d_locked;
+    rhs.d_profiled = false;
+  }
+  return *this;
 }
 
 MDB_txn *MDBRWTransactionImpl::openRWTransaction(MDBEnv *env, MDB_txn *parent, int flags)
@@ -165,6 +553,8 @@ MDB_txn *MDBRWTransactionImpl::openRWTransaction(MDBEnv *env, MDB_txn *parent, i
   if(env->getROTX() || env->getRWTX())
     throw std::runtime_error("Duplicate RW transaction");
 
+  MDBOpTimer timer(env->threadMetrics(), MDBOp::BeginRW);
+  env->incRWTX(); // before mdb_txn_begin, so we wait if the map is being resized
   for(int tries =0 ; tries < 3; ++tries) { // it might happen twice, who knows
     if(int rc=mdb_txn_begin(env->d_env, parent, flags, &result)) {
       if(rc == MDB_MAP_RESIZED && tries < 2) {
@@ -173,11 +563,12 @@ MDB_txn *MDBRWTransactionImpl::openRWTransaction(MDBEnv *env, MDB_txn *parent, i
         mdb_env_set_mapsize(env->d_env, 0);
         continue;
       }
+      env->decRWTX();
       throw std::runtime_error("Unable to start RW transaction: "+std::string(mdb_strerror(rc)));
     }
     break;
   }
-  env->incRWTX();
+  timer.done(0);
   return result;
 }
 
@@ -193,26 +584,57 @@ MDBRWTransactionImpl::~MDBRWTransactionImpl()
 
 void MDBRWTransactionImpl::commit()
 {
+  ++d_rw_cursors.d_writes;
   closeRORWCursors();
   if (!d_txn) {
     return;
   }
 
-  if(int rc = mdb_txn_commit(d_txn)) {
-    throw std::runtime_error("committing: " + std::string(mdb_strerror(rc)));
-  }
+  MDBOpTimer timer(d_rw_cursors.d_metrics, MDBOp::Commit);
+  auto start = d_profiled ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+  int rc = mdb_txn_commit(d_txn);
+  // on failure, mdb_txn_commit has aborted the transaction
   environment().decRWTX();
   d_txn = nullptr;
+  if(d_profiled)
+    profileEnd(std::chrono::steady_clock::now() - start, rc != 0);
+  if(rc) {
+    throw MDBException("committing", rc);
+  }
+  timer.done(0);
+}
+
+static std::future<void> readyFuture()
+{
+  std::promise<void> p;
+  p.set_value();
+  return p.get_future();
+}
+
+std::future<void> MDBRWTransactionImpl::commit(MDBDurability durability)
+{
+  if(!d_txn || d_child) {
+    commit();
+    return readyFuture();
+  }
+  size_t txnid = mdb_txn_id(d_txn); // the id this transaction gets once committed
+  commit();
+  return environment().afterCommit(txnid, durability);
 }
 
 void MDBRWTransactionImpl::abort()
 {
+  ++d_rw_cursors.d_writes;
   closeRORWCursors();
   if (!d_txn) {
     return;
   }
 
+  MDBOpTimer timer(d_rw_cursors.d_metrics, MDBOp::Abort);
   mdb_txn_abort(d_txn);
+  timer.done(0);
+  if(d_profiled)
+    profileEnd(std::chrono::nanoseconds(0), true);
   // prevent the RO destructor from cleaning up the transaction itself
   environment().decRWTX();
   d_txn = nullptr;
@@ -220,10 +642,11 @@ void MDBRWTransactionImpl::abort()
 
 MDBROTransactionImpl::MDBROTransactionImpl(MDBEnv *parent, MDB_txn *txn):
   d_parent(parent),
-  d_cursors(),
-  d_txn(txn)
+  d_txn(txn),
+  d_cursors()
 {
-
+  d_cursors.d_recycler = parent;
+  d_cursors.d_metrics = parent->threadMetrics();
 }
 
 MDB_txn *MDBROTransactionImpl::openROTransaction(MDBEnv *env, MDB_txn *parent, int flags)
@@ -234,6 +657,9 @@ MDB_txn *MDBROTransactionImpl::openROTransaction(MDBEnv *env, MDB_txn *parent, i
   /*
     A transaction and its cursors must only be used by a single thread, and a thread may only have a single transaction at a time. If MDB_NOTLS is in use, this does not apply to read-only transactions. */
   MDB_txn *result = nullptr;
+  MDBOpTimer timer(env->threadMetrics(), MDBOp::BeginRO);
+  std::chrono::steady_clock::time_point deadline;
+  env->incROTX(); // before mdb_txn_begin, so we wait if the map is being resized
   for(int tries =0 ; tries < 3; ++tries) { // it might happen twice, who knows
     if(int rc=mdb_txn_begin(env->d_env, parent, MDB_RDONLY | flags, &result)) {
       if(rc == MDB_MAP_RESIZED && tries < 2) {
@@ -243,22 +669,31 @@ MDB_txn *MDBROTransactionImpl::openROTransaction(MDBEnv *env, MDB_txn *parent, i
         continue;
       }
 
+      env->decROTX();
+      if(rc == MDB_READERS_FULL) {
+        // don't count as a transaction while waiting, a resize would wait for us
+        bool again = env->waitForReaderSlot(deadline);
+        env->incROTX();
+        if(again) {
+          --tries;
+          continue;
+        }
+        env->decROTX();
+        throw MDBException("Unable to start RO transaction", rc);
+      }
       throw std::runtime_error("Unable to start RO transaction: "+string(mdb_strerror(rc)));
     }
     break;
   }
-  env->incROTX();
-
+  timer.done(0);
   return result;
 }
 
 void MDBROTransactionImpl::closeROCursors()
 {
-  // we need to move the vector away to ensure that the cursors don’t mess with our iteration.
-  std::vector<MDBROCursor*> buf;
-  std::swap(d_cursors, buf);
-  for (auto &cursor: buf) {
-    cursor->close();
+  // closing a cursor unlinks it, so this walks the list
+  while (d_cursors.d_head) {
+    d_cursors.d_head->close();
   }
 }
 
@@ -268,41 +703,193 @@ MDBROTransactionImpl::MDBROTransactionImpl(MDBEnv *parent, int flags):
 
 }
 
+MDBROTransactionImpl::MDBROTransactionImpl(MDBROTransactionImpl&& rhs) :
+  MDBROTransactionImpl()
+{
+  if(rhs.d_rw)
+    throw std::runtime_error("Attempt to move a RW transaction into a RO one");
+  takeFrom(rhs);
+}
+
+MDBROTransactionImpl& MDBROTransactionImpl::operator=(MDBROTransactionImpl&& rhs)
+{
+  if(rhs.d_rw || d_rw)
+    throw std::runtime_error("Attempt to move a RW transaction into a RO one");
+  if(this != &rhs) {
+    finish(true);
+    takeFrom(rhs);
+  }
+  return *this;
+}
+
+// we are empty, or just finished
+void MDBROTransactionImpl::takeFrom(MDBROTransactionImpl& src)
+{
+  d_parent = src.d_parent;
+  d_pooled = src.d_pooled;
+  d_rw = src.d_rw;
+  d_txn = src.d_txn;
+  src.d_txn = nullptr;
+  d_cursors.take(src.d_cursors);
+  if(src.d_watchSlot)
+    d_parent->rewatchReader(src, *this);
+}
+
 MDBROTransactionImpl::~MDBROTransactionImpl()
 {
-  // this is safe because C++ will not call overrides of virtual methods in destructors.
-  commit();
+  // for a RW transaction, ~MDBRWTransactionImpl already aborted
+  finish(true);
 }
 
-void MDBROTransactionImpl::abort()
+void MDBROTransactionImpl::finish(bool commit)
 {
   closeROCursors();
-  // if d_txn is non-nullptr here, either the transaction object was invalidated earlier (e.g. by moving from it), or it is an RW transaction which has already cleaned up the d_txn pointer (with an abort).
+  // if d_txn is nullptr here, either the transaction object was invalidated earlier (e.g. by moving from it), or it is an RW transaction which has already cleaned up the d_txn pointer (with an abort).
   if (d_txn) {
+    if(d_watchSlot)
+      d_parent->unwatchReader(*this);
     d_parent->decROTX();
-    mdb_txn_abort(d_txn); // this appears to work better than abort for r/o database opening
+    if(d_pooled)
+      d_parent->returnPooledROTransaction(d_txn);
+    else {
+      if(commit)
+        mdb_txn_commit(d_txn); // this appears to work better than abort for r/o database opening
+      else
+        mdb_txn_abort(d_txn);
+      d_parent->readerSlotFreed();
+    }
     d_txn = nullptr;
   }
 }
 
+void MDBROTransactionImpl::abort()
+{
+  if(d_rw)
+    static_cast<MDBRWTransactionImpl*>(this)->abort();
+  else
+    finish(false);
+}
+
 void MDBROTransactionImpl::commit()
 {
-  closeROCursors();
-  // if d_txn is non-nullptr here, either the transaction object was invalidated earlier (e.g. by moving from it), or it is an RW transaction which has already cleaned up the d_txn pointer (with an abort).
-  if (d_txn) {
-    d_parent->decROTX();
-    mdb_txn_commit(d_txn); // this appears to work better than abort for r/o database opening
-    d_txn = nullptr;
-  }
+  if(d_rw)
+    static_cast<MDBRWTransactionImpl*>(this)->commit();
+  else
+    finish(true);
+}
+
+void MDBTransactionDeleter::operator()(MDBROTransactionImpl* txn) const
+{
+  if(txn->d_rw)
+    delete static_cast<MDBRWTransactionImpl*>(txn);
+  else
+    delete txn;
 }
 
 
 
 void MDBRWTransactionImpl::clear(MDB_dbi dbi)
 {
+  ++d_rw_cursors.d_writes;
   if(int rc = mdb_drop(d_txn, dbi, 0)) {
-    throw runtime_error("Error clearing database: " + MDBError(rc));
+    throw MDBException("Error clearing database", rc);
+  }
+}
+
+MDBReservation MDBRWTransactionImpl::reserve(MDB_dbi dbi, const MDBInVal& key, size_t size, int flags)
+{
+  if(!d_txn)
+    throw std::runtime_error("Attempt to use a closed RW transaction for reserve");
+
+  unsigned int dbflags;
+  if(int rc = mdb_dbi_flags(d_txn, dbi, &dbflags))
+    throw MDBException("getting database flags", rc);
+  if(dbflags & MDB_DUPSORT)
+    throw std::runtime_error("MDB_RESERVE can not be used with MDB_DUPSORT databases");
+
+  ++d_rw_cursors.d_writes;
+  MDB_val data{size, nullptr};
+  if(int rc = mdb_put(d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval), &data, flags | MDB_RESERVE))
+    throw MDBException("reserving data", rc);
+  return MDBReservation((char*)data.mv_data, size, &d_rw_cursors.d_writes);
+}
+
+MDBScanRange::MDBScanRange(MDB_cursor* cursor, bool reverse, string_view lo, string_view hi, bool prefix,
+                           MDBThreadMetrics* metrics) :
+  d_cursor(cursor), d_reverse(reverse), d_prefix(prefix), d_bounded(!prefix && (!lo.empty() || !hi.empty())),
+  d_metrics(metrics)
+{
+  d_lo.mv_size = lo.size();
+  d_lo.mv_data = (void*)lo.data();
+  d_hi.mv_size = hi.size();
+  d_hi.mv_data = (void*)hi.data();
+}
+
+MDBScanIterator MDBScanRange::begin() const
+{
+  typedef MDBScanIterator::Limit Limit;
+  if(d_prefix) {
+    unsigned int dbflags;
+    if(int rc = mdb_dbi_flags(mdb_cursor_txn(d_cursor), mdb_cursor_dbi(d_cursor), &dbflags))
+      throw MDBException("getting database flags", rc);
+    if(dbflags & (MDB_INTEGERKEY | MDB_REVERSEKEY))
+      throw std::runtime_error("Prefix scans need a database in byte order");
+    MDBScanIterator ret(d_cursor, MDB_NEXT, Limit::Prefix, d_lo, d_metrics);
+    // every key starts with an empty prefix, and LMDB refuses empty keys
+    ret.start(d_lo.mv_size ? MDB_SET_RANGE : MDB_FIRST, d_lo);
+    return ret;
+  }
+  if(!d_reverse) {
+    MDBScanIterator ret(d_cursor, MDB_NEXT, d_hi.mv_size ? Limit::Below : Limit::None, d_hi, d_metrics);
+    if(d_lo.mv_size)
+      ret.start(MDB_SET_RANGE, d_lo);
+    else
+      ret.start(MDB_FIRST, d_lo);
+    return ret;
+  }
+
+  MDBScanIterator ret(d_cursor, MDB_PREV, d_lo.mv_size ? Limit::AtLeast : Limit::None, d_lo, d_metrics);
+  if(d_bounded && d_hi.mv_size) {
+    // hi is not part of the range, so we start at the key before it
+    MDB_val key = d_hi, val;
+    int rc = mdb_cursor_get(d_cursor, &key, &val, MDB_SET_RANGE);
+    if(!rc) {
+      ret.start(MDB_PREV, key);
+      return ret;
+    }
+    if(rc != MDB_NOTFOUND)
+      throw MDBException("Unable to scan from cursor", rc);
+  }
+  ret.start(MDB_LAST, d_hi);
+  return ret;
+}
+
+size_t MDBPutMultipleRaw(MDB_cursor* cursor, const MDB_val& key, const char* values, size_t size, size_t count, int flags)
+{
+  size_t stored = 0;
+  while(count) {
+    MDB_val k = key;
+    MDB_val data[2];
+    data[0].mv_size = size;
+    data[0].mv_data = (void*)values;
+    data[1].mv_size = count;
+    data[1].mv_data = nullptr;
+    int rc = mdb_cursor_put(cursor, &k, data, flags | MDB_MULTIPLE);
+
+    size_t done = data[1].mv_size; // LMDB sets this to how many made it, also if it stopped early
+    stored += done;
+    values += done * size;
+    count -= done;
+    if(rc == MDB_KEYEXIST && (flags & MDB_NODUPDATA)) {
+      values += size; // this one was there already, carry on with the rest
+      --count;
+    }
+    else if(rc)
+      throw MDBException("putting multiple values", rc);
+    else if(!done)
+      break; // never loop forever
   }
+  return stored;
 }
 
 MDBRWCursor MDBRWTransactionImpl::getRWCursor(const MDBDbi& dbi)
@@ -320,7 +907,7 @@ MDBRWCursor MDBRWTransactionImpl::getCursor(const MDBDbi &dbi)
   return getRWCursor(dbi);
 }
 
-MDBRWTransaction MDBRWTransactionImpl::getRWTransaction()
+MDB_txn* MDBRWTransactionImpl::openChild()
 {
   MDB_txn *txn;
   if (int rc = mdb_txn_begin(environment(), *this, 0, &txn)) {
@@ -328,7 +915,22 @@ MDBRWTransaction MDBRWTransactionImpl::getRWTransaction()
   }
   // we need to increase the counter here because commit/abort on the child transaction will decrease it
   environment().incRWTX();
-  return MDBRWTransaction(new MDBRWTransactionImpl(&environment(), txn));
+  ++d_rw_cursors.d_writes; // the child writes to our pages
+  return txn;
+}
+
+MDBRWTransaction MDBRWTransactionImpl::getRWTransaction()
+{
+  MDBRWTransaction ret(new MDBRWTransactionImpl(&environment(), openChild()));
+  ret->d_child = true;
+  return ret;
+}
+
+MDBRWTransactionImpl MDBRWTransactionImpl::beginRW()
+{
+  MDBRWTransactionImpl ret(&environment(), openChild());
+  ret.d_child = true;
+  return ret;
 }
 
 MDBROTransaction MDBRWTransactionImpl::getROTransaction()
@@ -336,22 +938,56 @@ MDBROTransaction MDBRWTransactionImpl::getROTransaction()
   return std::move(getRWTransaction());
 }
 
-MDBROTransaction MDBEnv::getROTransaction()
+MDBROTransaction MDBEnv::getROTransaction(const char* site)
+{
+  MDBROTransaction ret(new MDBROTransactionImpl(this));
+  if(d_watchReaders)
+    watchReader(*ret, site);
+  return ret;
+}
+MDBRWTransaction MDBEnv::getRWTransaction(const char* site)
+{
+  if(!d_profileWriters)
+    return MDBRWTransaction(new MDBRWTransactionImpl(this));
+
+  auto start = std::chrono::steady_clock::now();
+  MDBRWTransaction ret(new MDBRWTransactionImpl(this));
+  profileWriter(*ret, site, start);
+  return ret;
+}
+
+MDBROTransactionImpl MDBEnv::beginRO(const char* site)
 {
-  return MDBROTransaction(new MDBROTransactionImpl(this));
+  MDBROTransactionImpl ret(this);
+  if(d_watchReaders)
+    watchReader(ret, site);
+  return ret;
+}
+
+MDBRWTransactionImpl MDBEnv::beginRW(const char* site)
+{
+  if(!d_profileWriters)
+    return MDBRWTransactionImpl(this);
+
+  auto start = std::chrono::steady_clock::now();
+  MDBRWTransactionImpl ret(this);
+  profileWriter(ret, site, start);
+  return ret;
 }
-MDBRWTransaction MDBEnv::getRWTransaction()
+
+void MDBEnv::profileWriter(MDBRWTransactionImpl& txn, const char* site, std::chrono::steady_clock::time_point start)
 {
-  return MDBRWTransaction(new MDBRWTransactionImpl(this));
+  txn.d_profiled = true;
+  txn.d_site = site;
+  txn.d_locked = std::chrono::steady_clock::now();
+  txn.d_wait = txn.d_locked - start;
 }
 
 
 void MDBRWTransactionImpl::closeRWCursors()
 {
-  decltype(d_rw_cursors) buf;
-  std::swap(d_rw_cursors, buf);
-  for (auto &cursor: buf) {
-    cursor->close();
+  while (d_rw_cursors.d_head) {
+    d_rw_cursors.d_head->close();
   }
 }
 
@@ -363,9 +999,1301 @@ MDBROCursor MDBROTransactionImpl::getCursor(const MDBDbi& dbi)
 MDBROCursor MDBROTransactionImpl::getROCursor(const MDBDbi &dbi)
 {
   MDB_cursor *cursor;
+  if(d_cursors.d_recycler && (cursor = d_parent->takeROCursor(dbi))) {
+    if(!mdb_cursor_renew(d_txn, cursor))
+      return MDBROCursor(d_cursors, cursor);
+    mdb_cursor_close(cursor);
+  }
   int rc= mdb_cursor_open(d_txn, dbi, &cursor);
   if(rc) {
     throw std::runtime_error("Error creating RO cursor: "+std::string(mdb_strerror(rc)));
   }
   return MDBROCursor(d_cursors, cursor);
 }
+
+size_t MDBROTransactionImpl::getMany(MDB_dbi dbi, MDBSpan<const string_view> keys, string_view* vals, bool sorted)
+{
+  if(!d_txn)
+    throw std::runtime_error("Attempt to use a closed transaction for getMany");
+
+  vector<MDB_val> wanted(keys.size());
+  for(size_t n = 0; n < keys.size(); ++n)
+    wanted[n] = MDB_val{keys[n].size(), (void*)keys[n].data()};
+
+  vector<size_t> order(keys.size());
+  for(size_t n = 0; n < order.size(); ++n)
+    order[n] = n;
+  if(!sorted)
+    std::sort(order.begin(), order.end(), [this, dbi, &wanted](size_t a, size_t b) {
+        return mdb_cmp(d_txn, dbi, &wanted[a], &wanted[b]) < 0;
+      });
+
+  MDB_cursor* cursor;
+  if(int rc = mdb_cursor_open(d_txn, dbi, &cursor))
+    throw MDBException("Error creating cursor for getMany", rc);
+
+  // 'key' is where the cursor is, the first key at or after the previous one we looked for
+  size_t found = 0;
+  try {
+    MDB_val key, data;
+    bool positioned = false, exhausted = false;
+    for(size_t n : order) {
+      const MDB_val& want = wanted[n];
+      vals[n] = string_view();
+      int c = positioned ? mdb_cmp(d_txn, dbi, &want, &key) : 1;
+      if(c > 0 && exhausted)
+        continue; // after the last key
+      if(c > 0 && positioned) {
+        // probably close by, so try the next key before descending again
+        int rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_NODUP);
+        if(rc == MDB_NOTFOUND) {
+          exhausted = true;
+          continue;
+        }
+        if(rc)
+          throw MDBException("Unable to step cursor for getMany", rc);
+        c = mdb_cmp(d_txn, dbi, &want, &key);
+      }
+      if(c > 0) {
+        MDB_val probe = want;
+        int rc = mdb_cursor_get(cursor, &probe, &data, MDB_SET_RANGE);
+        if(rc == MDB_NOTFOUND) {
+          exhausted = true;
+          continue;
+        }
+        if(rc)
+          throw MDBException("Unable to position cursor for getMany", rc);
+        key = probe;
+        positioned = true;
+        c = mdb_cmp(d_txn, dbi, &want, &key);
+      }
+      // c < 0 means we are between two keys that are there, so want is not
+      if(!c) {
+        vals[n] = string_view((const char*)data.mv_data, data.mv_size);
+        ++found;
+      }
+    }
+  }
+  catch(...) {
+    mdb_cursor_close(cursor);
+    throw;
+  }
+  mdb_cursor_close(cursor);
+  return found;
+}
+
+void MDBWriteBatch::apply(MDBRWTransactionImpl& txn) const
+{
+  for(const auto& op : d_ops) {
+    MDBDbi dbi;
+    dbi.d_dbi = op.d_dbi;
+    switch(op.d_type) {
+    case Op::Type::Put:
+      txn.put(dbi, op.d_key, op.d_val, op.d_flags);
+      break;
+    case Op::Type::Del:
+      txn.del(dbi, op.d_key);
+      break;
+    case Op::Type::DelValue:
+      txn.del(dbi, op.d_key, op.d_val);
+      break;
+    }
+  }
+}
+
+/* The thread behind MDBEnv::submit(). It takes the first queued batch, and then
+   keeps applying batches until the queue is empty or the latency budget is
+   spent, after which it commits. While it commits, new batches pile up for the
+   next round, so the busier it gets, the larger the groups. If the previous
+   group was larger, an empty queue is probably temporary, and we wait for it
+   until the budget is spent. A lone writer never waits. */
+class MDBGroupCommitter
+{
+public:
+  explicit MDBGroupCommitter(MDBEnv& env) : d_env(env)
+  {
+    unsigned int flags;
+    mdb_env_get_flags(d_env.d_env, &flags);
+    d_nested = !(flags & MDB_WRITEMAP); // LMDB has no nested transactions with MDB_WRITEMAP
+    d_thread = std::thread(&MDBGroupCommitter::run, this);
+  }
+
+  ~MDBGroupCommitter()
+  {
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      d_stop = true;
+    }
+    d_cv.notify_one();
+    d_thread.join();
+  }
+
+  std::future<void> submit(MDBWriteBatch&& batch)
+  {
+    Pending p;
+    p.d_batch = std::move(batch);
+    auto ret = p.d_promise.get_future();
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      d_queue.push_back(std::move(p));
+    }
+    d_cv.notify_one();
+    return ret;
+  }
+
+private:
+  struct Pending
+  {
+    MDBWriteBatch d_batch;
+    std::promise<void> d_promise;
+  };
+
+  struct Replay {}; // the transaction has to start over without the batch that failed
+
+  void run();
+  bool take(Pending& p, bool linger, std::chrono::steady_clock::time_point deadline);
+  bool apply(MDBRWTransactionImpl& txn, Pending& p);
+  void commitGroup(std::vector<Pending>& group);
+
+  MDBEnv& d_env;
+  bool d_nested;
+  std::mutex d_mut;
+  std::condition_variable d_cv;
+  std::deque<Pending> d_queue;
+  bool d_stop{false};
+  size_t d_lastGroup{0};
+  std::thread d_thread;
+};
+
+void MDBGroupCommitter::run()
+{
+  for(;;) {
+    std::vector<Pending> group;
+    {
+      std::unique_lock<std::mutex> l(d_mut);
+      d_cv.wait(l, [this]() { return d_stop || !d_queue.empty(); });
+      if(d_queue.empty()) // so we only stop once everything has been committed
+        return;
+      group.push_back(std::move(d_queue.front()));
+      d_queue.pop_front();
+    }
+    commitGroup(group);
+  }
+}
+
+bool MDBGroupCommitter::take(Pending& p, bool linger, std::chrono::steady_clock::time_point deadline)
+{
+  std::unique_lock<std::mutex> l(d_mut);
+  if(linger)
+    d_cv.wait_until(l, deadline, [this]() { return d_stop || !d_queue.empty(); });
+  if(d_queue.empty())
+    return false;
+  p = std::move(d_queue.front());
+  d_queue.pop_front();
+  return true;
+}
+
+// returns false if the batch failed, in which case its promise has been fulfilled already
+bool MDBGroupCommitter::apply(MDBRWTransactionImpl& txn, Pending& p)
+{
+  try {
+    if(d_nested) {
+      auto child = txn.getRWTransaction();
+      p.d_batch.apply(*child);
+      child->commit();
+    }
+    else
+      p.d_batch.apply(txn);
+    return true;
+  }
+  catch(const MDBException& e) {
+    if(e.getRC() == MDB_MAP_FULL)
+      throw; // not this batch's fault, the whole group tries again in a larger map
+    p.d_promise.set_exception(std::current_exception());
+  }
+  catch(...) {
+    p.d_promise.set_exception(std::current_exception());
+  }
+  return false;
+}
+
+void MDBGroupCommitter::commitGroup(std::vector<Pending>& group)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(d_env.d_groupLatency.load());
+  size_t seen = d_env.getMapSize();
+  for(;;) {
+    try {
+      auto txn = d_env.getRWTransaction("MDBEnv::submit");
+      Pending p;
+      // batches from an earlier attempt go first
+      for(size_t n = 0; ; ) {
+        if(n == group.size()) {
+          // writers we just released are probably about to submit again, so if the last group
+          // was larger than this one, we give them until the deadline
+          if(std::chrono::steady_clock::now() >= deadline || !take(p, group.size() < d_lastGroup, deadline))
+            break;
+          group.push_back(std::move(p));
+        }
+        if(apply(*txn, group[n]))
+          ++n;
+        else {
+          group.erase(group.begin() + n);
+          if(!d_nested) // the failed batch may have left some of its writes behind
+            throw Replay();
+        }
+      }
+      txn->commit();
+      d_lastGroup = group.size();
+      for(auto& g : group)
+        g.d_promise.set_value();
+      return;
+    }
+    catch(const Replay&) {
+      continue;
+    }
+    catch(const MDBException& e) {
+      if(e.getRC() == MDB_MAP_FULL && d_env.growMap(seen)) {
+        seen = d_env.getMapSize();
+        continue;
+      }
+      for(auto& g : group)
+        g.d_promise.set_exception(std::current_exception());
+      return;
+    }
+    catch(...) {
+      for(auto& g : group)
+        g.d_promise.set_exception(std::current_exception());
+      return;
+    }
+  }
+}
+
+std::future<void> MDBEnv::submit(MDBWriteBatch batch)
+{
+  if(getRWTX())
+    throw std::runtime_error("Can't submit a write batch while holding a RW transaction");
+  std::call_once(d_committerOnce, [this]() { d_committer.reset(new MDBGroupCommitter(*this)); });
+  return d_committer->submit(std::move(batch));
+}
+
+/* Makes commits durable for MDBRWTransactionImpl::commit(MDBDurability). Our
+   thread syncs as soon as someone waits for a commit, and while it syncs, new
+   waiters pile up for the next round. Commits nobody waits for get synced
+   within the lazy sync interval. One mdb_env_sync() covers everything that was
+   committed before it started, which is what makes sharing it possible. */
+class MDBSyncer
+{
+public:
+  explicit MDBSyncer(MDBEnv& env) : d_env(env)
+  {
+    d_thread = std::thread(&MDBSyncer::run, this);
+  }
+
+  ~MDBSyncer()
+  {
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      d_stop = true;
+    }
+    d_cv.notify_one();
+    d_thread.join();
+  }
+
+  // syncs on the calling thread, unless someone else did so since txnid got committed
+  void syncNow(size_t txnid)
+  {
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      if(d_durable >= txnid)
+        return;
+    }
+    sync(txnid);
+  }
+
+  std::future<void> whenDurable(size_t txnid)
+  {
+    std::promise<void> p;
+    auto ret = p.get_future();
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      if(d_durable >= txnid)
+        p.set_value();
+      else
+        d_waiters.emplace_back(txnid, std::move(p));
+    }
+    d_cv.notify_one();
+    return ret;
+  }
+
+  void syncLater(size_t txnid)
+  {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      wake = d_dirty <= d_durable; // run() may be waiting without a timeout
+      d_dirty = std::max(d_dirty, txnid);
+    }
+    if(wake)
+      d_cv.notify_one();
+  }
+
+private:
+  void run();
+  void sync(size_t txnid);
+
+  MDBEnv& d_env;
+  std::mutex d_syncmut; // one mdb_env_sync at a time, so whoever waits for it can find the work done
+  std::mutex d_mut;
+  std::condition_variable d_cv;
+  std::vector<std::pair<size_t, std::promise<void>>> d_waiters;
+  size_t d_durable{0}; // everything up to this txnid is on disk
+  size_t d_dirty{0}; // highest txnid committed with FireAndForget
+  bool d_stop{false};
+  std::thread d_thread;
+};
+
+// makes sure everything up to txnid is on disk, and whatever got committed before we started syncing
+void MDBSyncer::sync(size_t txnid)
+{
+  std::lock_guard<std::mutex> l(d_syncmut);
+  {
+    std::lock_guard<std::mutex> l2(d_mut);
+    if(d_durable >= txnid) // done while we waited for d_syncmut
+      return;
+  }
+  MDB_envinfo info;
+  mdb_env_info(d_env.d_env, &info);
+  size_t upto = info.me_last_txnid;
+  if(int rc = mdb_env_sync(d_env.d_env, 1))
+    throw MDBException("syncing environment", rc);
+  std::lock_guard<std::mutex> l2(d_mut);
+  d_durable = std::max(d_durable, upto);
+  d_env.d_durableTxnid = d_durable;
+}
+
+void MDBSyncer::run()
+{
+  std::unique_lock<std::mutex> l(d_mut);
+  for(;;) {
+    if(d_waiters.empty() && !d_stop) {
+      if(d_dirty > d_durable)
+        d_cv.wait_for(l, std::chrono::milliseconds(d_env.d_lazySyncInterval.load()),
+                      [this]() { return d_stop || !d_waiters.empty(); });
+      else {
+        d_cv.wait(l, [this]() { return d_stop || !d_waiters.empty() || d_dirty > d_durable; });
+        continue; // dirty commits get the lazy sync interval from now
+      }
+    }
+    if(d_waiters.empty() && d_dirty <= d_durable) {
+      if(d_stop)
+        return;
+      continue;
+    }
+
+    size_t txnid = d_dirty;
+    for(const auto& w : d_waiters)
+      txnid = std::max(txnid, w.first);
+    l.unlock();
+    std::exception_ptr error;
+    try {
+      sync(txnid);
+    }
+    catch(...) {
+      error = std::current_exception();
+    }
+    l.lock();
+
+    for(auto iter = d_waiters.begin(); iter != d_waiters.end(); ) {
+      if(iter->first <= d_durable)
+        iter->second.set_value();
+      else if(error)
+        iter->second.set_exception(error);
+      else {
+        ++iter;
+        continue;
+      }
+      iter = d_waiters.erase(iter);
+    }
+  }
+}
+
+std::future<void> MDBEnv::afterCommit(size_t txnid, MDBDurability durability)
+{
+  unsigned int flags;
+  mdb_env_get_flags(d_env, &flags);
+  if(!(flags & (MDB_NOSYNC | MDB_NOMETASYNC)))
+    return readyFuture(); // LMDB synced already
+
+  std::call_once(d_syncerOnce, [this]() { d_syncer.reset(new MDBSyncer(*this)); });
+  switch(durability) {
+  case MDBDurability::Sync:
+    d_syncer->syncNow(txnid);
+    break;
+  case MDBDurability::AsyncDurable:
+    return d_syncer->whenDurable(txnid);
+  case MDBDurability::FireAndForget:
+    d_syncer->syncLater(txnid);
+    break;
+  }
+  return readyFuture();
+}
+
+// the bytes of key from offset on, as a big-endian number, so that it sorts like the key
+static uint64_t keyBits(const MDB_val& key, size_t offset)
+{
+  uint64_t ret = 0;
+  for(size_t n = offset; n < offset + 8; ++n)
+    ret = (ret << 8) | (n < key.mv_size ? ((const unsigned char*)key.mv_data)[n] : 0);
+  return ret;
+}
+
+/* Keys that split dbi into about 'parts' ranges. LMDB can not tell us the
+   n-th key, so we interpolate between the first and the last key, and take
+   the key that is there for each point. For MDB_INTEGERKEY we interpolate
+   the numbers, for MDB_REVERSEKEY we do not try. */
+static std::vector<std::string> splitKeySpace(MDBROTransactionImpl& txn, const MDBDbi& dbi, size_t parts)
+{
+  std::vector<std::string> ret;
+  unsigned int flags;
+  if(int rc = mdb_dbi_flags(txn, dbi, &flags))
+    throw MDBException("getting database flags", rc);
+  auto cursor = txn.getCursor(dbi);
+  MDBOutVal first, last, val;
+  if(parts < 2 || (flags & MDB_REVERSEKEY) || cursor.first(first, val) || cursor.last(last, val))
+    return ret;
+
+  size_t prefix = 0;
+  uint64_t lo, hi;
+  bool integer = (flags & MDB_INTEGERKEY) && (first.d_mdbval.mv_size == 4 || first.d_mdbval.mv_size == 8);
+  if(integer) {
+    lo = first.d_mdbval.mv_size == 4 ? first.get<uint32_t>() : first.get<uint64_t>();
+    hi = last.d_mdbval.mv_size == 4 ? last.get<uint32_t>() : last.get<uint64_t>();
+  }
+  else {
+    const MDB_val& a = first.d_mdbval, &b = last.d_mdbval;
+    while(prefix < a.mv_size && prefix < b.mv_size &&
+          ((const char*)a.mv_data)[prefix] == ((const char*)b.mv_data)[prefix])
+      ++prefix;
+    lo = keyBits(a, prefix);
+    hi = keyBits(b, prefix);
+  }
+  if(hi <= lo)
+    return ret;
+
+  std::string point;
+  MDBOutVal key;
+  for(size_t n = 1; n < parts; ++n) {
+    uint64_t at = lo + (hi - lo) / parts * n;
+    if(integer) {
+      uint32_t at32 = at;
+      if(first.d_mdbval.mv_size == 4)
+        point.assign((const char*)&at32, 4);
+      else
+        point.assign((const char*)&at, 8);
+    }
+    else {
+      point.assign((const char*)first.d_mdbval.mv_data, prefix);
+      for(int shift = 56; shift >= 0; shift -= 8)
+        point.push_back((char)(at >> shift));
+    }
+    if(cursor.lower_bound(point, key, val))
+      break;
+    // several points may land on the same key
+    if(!mdb_cmp(txn, dbi, &key.d_mdbval, &first.d_mdbval))
+      continue;
+    if(!ret.empty()) {
+      MDB_val prev{ret.back().size(), (void*)ret.back().data()};
+      if(!mdb_cmp(txn, dbi, &key.d_mdbval, &prev))
+        continue;
+    }
+    ret.push_back(key.get<std::string>());
+  }
+  return ret;
+}
+
+void MDBEnv::parallelScan(const MDBDbi& dbi, unsigned int threads,
+                          const std::function<void(unsigned int, MDBROCursor&, string_view, string_view)>& func)
+{
+  if(getRWTX() || getROTX())
+    throw std::runtime_error("parallelScan needs the write lock, so the calling thread can not hold a transaction");
+  if(!threads)
+    threads = 1;
+
+  std::vector<std::string> splits;
+  {
+    auto txn = getROTransaction("MDBEnv::parallelScan");
+    splits = splitKeySpace(*txn, dbi, threads > 1 ? threads * 8 : 1);
+  }
+  // range n runs from splits[n-1] to splits[n], the first and the last are open-ended
+  size_t ranges = splits.size() + 1;
+  std::atomic<size_t> next{0};
+
+  std::mutex mut;
+  std::condition_variable cv;
+  unsigned int opened = 0;
+  unsigned int round = 0; // bumped to have the workers open their transactions again
+  std::vector<size_t> txnids(threads);
+  bool go = false;
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+
+  auto worker = [&](unsigned int id) {
+    MDBROTransaction txn;
+    for(unsigned int mine = 0; ; ++mine) {
+      txn.reset();
+      try {
+        txn = getROTransaction("MDBEnv::parallelScan");
+      }
+      catch(...) {
+        std::lock_guard<std::mutex> l(mut);
+        if(!error)
+          error = std::current_exception();
+        failed = true;
+      }
+      std::unique_lock<std::mutex> l(mut);
+      txnids[id] = txn ? mdb_txn_id(*txn) : 0;
+      ++opened;
+      cv.notify_all();
+      cv.wait(l, [&]() { return go || round != mine; });
+      if(go)
+        break;
+    }
+    if(!txn)
+      return;
+
+    try {
+      auto cursor = txn->getCursor(dbi);
+      size_t n;
+      while(!failed && (n = next++) < ranges) {
+        string_view lo = n ? string_view(splits[n-1]) : string_view();
+        string_view hi = n < splits.size() ? string_view(splits[n]) : string_view();
+        func(id, cursor, lo, hi);
+      }
+    }
+    catch(...) {
+      std::lock_guard<std::mutex> l(mut);
+      if(!error)
+        error = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> workers;
+  {
+    unsigned int envflags;
+    mdb_env_get_flags(d_env, &envflags);
+    MDBRWTransaction lock; // no commits, also not from other processes, until all workers have their snapshot
+    if(!(envflags & MDB_RDONLY))
+      lock = getRWTransaction("MDBEnv::parallelScan");
+
+    try {
+      for(unsigned int n = 0; n < threads; ++n)
+        workers.emplace_back(worker, n);
+    }
+    catch(...) {
+      std::lock_guard<std::mutex> l(mut);
+      if(!error)
+        error = std::current_exception();
+      failed = true;
+      threads = workers.size();
+    }
+    std::unique_lock<std::mutex> l(mut);
+    for(unsigned int tries = 0; ; ++tries) {
+      cv.wait(l, [&]() { return opened == threads; });
+      // without the write lock, another process may have committed while the workers opened theirs
+      if(lock || failed || std::equal(txnids.begin() + 1, txnids.begin() + threads, txnids.begin()))
+        break;
+      if(tries == 100) {
+        if(!error)
+          error = std::make_exception_ptr(std::runtime_error("parallelScan could not get the same snapshot for all threads"));
+        failed = true;
+        break;
+      }
+      opened = 0;
+      ++round;
+      cv.notify_all();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> l(mut);
+    go = true;
+  }
+  cv.notify_all();
+
+  for(auto& w : workers)
+    w.join();
+  if(error)
+    std::rethrow_exception(error);
+}
+
+/* A read-only mapping of our own of the data file, as far as it is in use.
+   It shares the page cache with the map of LMDB, so what is in memory for
+   one is in memory for the other. We can not get at the map of LMDB itself,
+   mdb_env_info() only reports its address for MDB_FIXEDMAP. */
+class MDBFileView
+{
+public:
+  explicit MDBFileView(MDB_env* env)
+  {
+    MDB_envinfo info;
+    MDB_stat st;
+    mdb_env_info(env, &info);
+    mdb_env_stat(env, &st);
+    d_psize = st.ms_psize;
+    d_size = (info.me_last_pgno + 1) * d_psize;
+
+    mdb_filehandle_t fd;
+    if(int rc = mdb_env_get_fd(env, &fd))
+      throw MDBException("getting data file descriptor", rc);
+    d_data = (char*)mmap(nullptr, d_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(d_data == MAP_FAILED)
+      throw std::runtime_error("Unable to map data file: " + std::string(strerror(errno)));
+  }
+  ~MDBFileView()
+  {
+    munmap(d_data, d_size);
+  }
+  MDBFileView(const MDBFileView&) = delete;
+  MDBFileView& operator=(const MDBFileView&) = delete;
+
+  char* d_data;
+  size_t d_size;
+  size_t d_psize;
+};
+
+// reads a byte of every page, so we return only once they are all in memory
+static void touchPages(const char* data, size_t len, size_t psize)
+{
+  volatile char sink;
+  for(size_t off = 0; off < len; off += psize)
+    sink = data[off];
+  (void)sink;
+}
+
+/* Runs func(id, failed) on 'threads' threads. The first exception is thrown
+   here once all have finished, and sets 'failed', so that the others can stop
+   early. */
+static void runWorkers(unsigned int threads, const std::function<void(unsigned int, const std::atomic<bool>&)>& func)
+{
+  std::mutex mut;
+  std::exception_ptr error;
+  std::atomic<bool> failed{false};
+  auto fail = [&]() {
+    std::lock_guard<std::mutex> l(mut);
+    if(!error)
+      error = std::current_exception();
+    failed = true;
+  };
+
+  std::vector<std::thread> workers;
+  try {
+    for(unsigned int n = 0; n < std::max(threads, 1U); ++n)
+      workers.emplace_back([&, n]() {
+          try {
+            func(n, failed);
+          }
+          catch(...) {
+            fail();
+          }
+        });
+  }
+  catch(...) {
+    fail();
+  }
+  for(auto& w : workers)
+    w.join();
+  if(error)
+    std::rethrow_exception(error);
+}
+
+size_t MDBEnv::warmup(size_t budget, unsigned int threads, const std::function<void(size_t, size_t)>& progress)
+{
+  MDBFileView view(d_env);
+  size_t total = std::min(budget, view.d_size);
+  const size_t chunk = std::max<size_t>(4 << 20, view.d_psize);
+  std::atomic<size_t> next{0};
+  std::mutex mut;
+  size_t done = 0;
+
+  runWorkers(threads, [&](unsigned int, const std::atomic<bool>& failed) {
+      size_t off;
+      while(!failed && (off = next.fetch_add(chunk)) < total) {
+        size_t len = std::min(chunk, total - off);
+        madvise(view.d_data + off, len, MADV_WILLNEED);
+        touchPages(view.d_data + off, len, view.d_psize);
+        std::lock_guard<std::mutex> l(mut);
+        done += len;
+        if(progress)
+          progress(done, total);
+      }
+    });
+  return done;
+}
+
+size_t MDBEnv::warmup(const MDBDbi& dbi, size_t budget, unsigned int threads, const std::function<void(size_t, size_t)>& progress)
+{
+  MDB_stat st;
+  {
+    auto txn = getROTransaction();
+    if(int rc = mdb_stat(*txn, dbi, &st))
+      throw MDBException("getting database statistics", rc);
+  }
+  const size_t psize = st.ms_psize;
+  size_t total = std::min(budget, (st.ms_branch_pages + st.ms_leaf_pages + st.ms_overflow_pages) * psize);
+  std::atomic<size_t> counted{0};
+  std::mutex mut;
+  size_t done = 0;
+
+  auto pageOf = [psize](const char* p) {
+    return (const char*)((uintptr_t)p & ~(uintptr_t)(psize - 1));
+  };
+  auto report = [&](size_t& mine) {
+    if(!mine)
+      return;
+    counted += mine;
+    std::lock_guard<std::mutex> l(mut);
+    done += mine;
+    mine = 0;
+    if(progress)
+      progress(std::min(done, total), total);
+  };
+
+  parallelScan(dbi, threads, [&](unsigned int, MDBROCursor& cursor, string_view lo, string_view hi) {
+      const char *keyPage = nullptr, *valPage = nullptr;
+      size_t mine = 0;
+      for(const auto& kv : cursor.scan(lo, hi)) {
+        if(counted + mine >= total)
+          break;
+        // getting here touched the leaf page already
+        const char* page = pageOf(kv.first.data());
+        if(page != keyPage) {
+          keyPage = page;
+          mine += psize;
+        }
+        // values that do not fit on the leaf are on pages of their own
+        if(!kv.second.empty() && pageOf(kv.second.data()) != keyPage) {
+          const char* first = pageOf(kv.second.data());
+          const char* last = pageOf(kv.second.data() + kv.second.size() - 1);
+          if(first != valPage) {
+            madvise((void*)first, last - first + psize, MADV_WILLNEED);
+            touchPages(first, last - first + psize, psize);
+            mine += last - first + psize;
+          }
+          valPage = last;
+        }
+        if(mine >= (1 << 20))
+          report(mine);
+      }
+      report(mine);
+    });
+  return std::min(done, total);
+}
+
+namespace {
+// what saveHotPages() writes, followed by the bitmap, a bit per page, lowest page in the lowest bit
+struct MDBHotPageHeader
+{
+  char d_magic[8];
+  uint32_t d_pagesize;
+  uint32_t d_reserved;
+  uint64_t d_pages;
+};
+const char s_hotPageMagic[8] = {'L', 'M', 'D', 'B', 'H', 'O', 'T', '1'};
+}
+
+void MDBEnv::saveHotPages(const std::string& fname)
+{
+  MDBFileView view(d_env);
+  const size_t ospage = sysconf(_SC_PAGESIZE);
+  const size_t pages = (view.d_size + ospage - 1) / ospage;
+  std::string bitmap((pages + 7) / 8, 0);
+
+  // in steps, so we don't need a byte per page of a huge map
+  const size_t step = 1 << 16;
+  std::vector<unsigned char> resident(step);
+  for(size_t from = 0; from < pages; from += step) {
+    size_t count = std::min(step, pages - from);
+    if(mincore(view.d_data + from * ospage, std::min(count * ospage, view.d_size - from * ospage), resident.data()))
+      throw std::runtime_error("Unable to see what is in memory: " + std::string(strerror(errno)));
+    for(size_t n = 0; n < count; ++n)
+      if(resident[n] & 1)
+        bitmap[(from + n) / 8] |= 1 << ((from + n) % 8);
+  }
+
+  MDBHotPageHeader header;
+  memcpy(header.d_magic, s_hotPageMagic, sizeof(header.d_magic));
+  header.d_pagesize = ospage;
+  header.d_reserved = 0;
+  header.d_pages = pages;
+
+  // so a crash halfway leaves the previous file
+  std::string tmpname = fname + ".tmp";
+  {
+    std::ofstream out(tmpname, std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write(bitmap.data(), bitmap.size());
+    out.close();
+    if(!out)
+      throw std::runtime_error("Unable to write hot pages to " + tmpname);
+  }
+  if(rename(tmpname.c_str(), fname.c_str()))
+    throw std::runtime_error("Unable to rename " + tmpname + " to " + fname + ": " + std::string(strerror(errno)));
+}
+
+size_t MDBEnv::restoreHotPages(const std::string& fname, unsigned int threads, const std::function<void(size_t, size_t)>& progress)
+{
+  struct stat statbuf;
+  if(stat(fname.c_str(), &statbuf)) {
+    if(errno == ENOENT)
+      return 0;
+    throw std::runtime_error("Unable to stat hot page file " + fname + ": " + std::string(strerror(errno)));
+  }
+  std::ifstream in(fname, std::ios::binary);
+  if(!in)
+    throw std::runtime_error("Unable to open hot page file " + fname);
+  const size_t ospage = sysconf(_SC_PAGESIZE);
+  MDBHotPageHeader header;
+  if(!in.read((char*)&header, sizeof(header)) || memcmp(header.d_magic, s_hotPageMagic, sizeof(header.d_magic)))
+    throw std::runtime_error(fname + " is not a hot page file");
+  if(header.d_pagesize != ospage)
+    throw std::runtime_error(fname + " was saved with pages of " + std::to_string(header.d_pagesize) + " bytes");
+  std::string bitmap((header.d_pages + 7) / 8, 0);
+  if(!in.read(&bitmap[0], bitmap.size()))
+    throw std::runtime_error(fname + " is truncated");
+
+  // the file may have shrunk since
+  MDBFileView view(d_env);
+  const size_t pages = std::min<size_t>(header.d_pages, view.d_size / ospage);
+  auto hot = [&bitmap](size_t n) {
+    return bitmap[n / 8] & (1 << (n % 8));
+  };
+  size_t total = 0;
+  for(size_t n = 0; n < pages; ++n)
+    if(hot(n))
+      total += ospage;
+
+  const size_t step = 8192; // pages per chunk of work
+  std::atomic<size_t> next{0};
+  std::mutex mut;
+  size_t done = 0;
+  runWorkers(threads, [&](unsigned int, const std::atomic<bool>& failed) {
+      size_t from;
+      while(!failed && !d_closing && (from = next.fetch_add(step)) < pages) {
+        size_t to = std::min(from + step, pages);
+        // advise all runs first, so the reads of this chunk are in flight together
+        std::vector<std::pair<size_t, size_t>> runs;
+        for(size_t n = from; n < to; ) {
+          if(!hot(n)) {
+            ++n;
+            continue;
+          }
+          size_t start = n;
+          while(n < to && hot(n))
+            ++n;
+          runs.emplace_back(start * ospage, (n - start) * ospage);
+          madvise(view.d_data + start * ospage, (n - start) * ospage, MADV_WILLNEED);
+        }
+        size_t mine = 0;
+        for(const auto& r : runs) {
+          touchPages(view.d_data + r.first, r.second, ospage);
+          mine += r.second;
+        }
+        if(!mine)
+          continue;
+        std::lock_guard<std::mutex> l(mut);
+        done += mine;
+        if(progress)
+          progress(done, total);
+      }
+    });
+  return done;
+}
+
+size_t MDBEnv::waitForHotPages()
+{
+  if(!d_hotPageRestore.valid())
+    return 0;
+  return d_hotPageRestore.get();
+}
+
+uint64_t MDBOpMetrics::timed() const
+{
+  uint64_t ret = 0;
+  for(auto n : d_latency)
+    ret += n;
+  return ret;
+}
+
+uint64_t MDBOpMetrics::percentile(double q) const
+{
+  uint64_t total = timed(), seen = 0;
+  if(!total)
+    return 0;
+  for(unsigned int bucket = 0; bucket < s_buckets; ++bucket) {
+    seen += d_latency[bucket];
+    if(seen >= q * total)
+      return 2ULL << bucket;
+  }
+  return 2ULL << (s_buckets - 1);
+}
+
+MDBMetrics MDBEnv::metrics()
+{
+  MDBMetrics ret;
+#if LMDB_SAFE_METRICS
+  std::lock_guard<std::mutex> l(d_slotmut);
+  for(const auto& slot : d_slots) {
+    for(int op = 0; op < (int)MDBOp::Max; ++op) {
+      const auto& from = slot->d_metrics.d_ops[op];
+      auto& to = ret.d_ops[op];
+      to.d_count += from.d_count.load(std::memory_order_relaxed);
+      to.d_notfound += from.d_notfound.load(std::memory_order_relaxed);
+      to.d_bytes += from.d_bytes.load(std::memory_order_relaxed);
+      for(unsigned int bucket = 0; bucket < MDBOpMetrics::s_buckets; ++bucket)
+        to.d_latency[bucket] += from.d_latency[bucket].load(std::memory_order_relaxed);
+    }
+  }
+#endif
+  return ret;
+}
+
+void MDBRWTransactionImpl::profileEnd(std::chrono::nanoseconds commit, bool aborted)
+{
+  // the lock was held until now, minus the commit itself
+  auto hold = std::chrono::steady_clock::now() - d_locked - commit;
+  d_profiled = false;
+  environment().recordWriter(d_site, d_wait, std::chrono::duration_cast<std::chrono::nanoseconds>(hold), commit, aborted);
+}
+
+void MDBEnv::setWriterProfiling(bool on)
+{
+  std::lock_guard<std::mutex> l(d_profilemut);
+  if(on)
+    d_profile.clear();
+  d_profileWriters = on;
+}
+
+void MDBEnv::recordWriter(const char* site, std::chrono::nanoseconds wait, std::chrono::nanoseconds hold,
+                          std::chrono::nanoseconds commit, bool aborted)
+{
+  std::string name = site ? site : "(unknown)";
+  std::lock_guard<std::mutex> l(d_profilemut);
+  auto& s = d_profile[name];
+  if(s.d_site.empty())
+    s.d_site = name;
+  ++s.d_count;
+  if(aborted)
+    ++s.d_aborts;
+  s.d_wait += wait;
+  s.d_hold += hold;
+  s.d_commit += commit;
+  s.d_maxHold = std::max(s.d_maxHold, hold + commit);
+}
+
+std::vector<MDBWriterSite> MDBEnv::writerProfile(size_t top)
+{
+  std::vector<MDBWriterSite> ret;
+  {
+    std::lock_guard<std::mutex> l(d_profilemut);
+    for(const auto& p : d_profile)
+      ret.push_back(p.second);
+  }
+  std::sort(ret.begin(), ret.end(), [](const MDBWriterSite& a, const MDBWriterSite& b) {
+      return a.locked() > b.locked();
+    });
+  if(ret.size() > top)
+    ret.resize(top);
+  return ret;
+}
+
+void MDBEnv::watchReader(MDBROTransactionImpl& txn, const char* site)
+{
+  auto& slot = getSlot();
+  txn.d_site = site;
+  txn.d_opened = std::chrono::steady_clock::now();
+  txn.d_txnid = mdb_txn_id(txn.d_txn);
+  std::lock_guard<std::mutex> l(slot.d_poolmut);
+  slot.d_open.push_back(&txn);
+  txn.d_watchSlot = &slot;
+}
+
+// txn may be closed by another thread than the one that opened it, so we go by d_watchSlot
+void MDBEnv::unwatchReader(MDBROTransactionImpl& txn)
+{
+  auto& open = txn.d_watchSlot->d_open;
+  std::lock_guard<std::mutex> l(txn.d_watchSlot->d_poolmut);
+  auto iter = std::find(open.begin(), open.end(), &txn);
+  if(iter != open.end()) {
+    *iter = open.back();
+    open.pop_back();
+  }
+  txn.d_watchSlot = nullptr;
+}
+
+// 'to' takes the place of 'from', which is being moved from
+void MDBEnv::rewatchReader(MDBROTransactionImpl& from, MDBROTransactionImpl& to)
+{
+  auto& open = from.d_watchSlot->d_open;
+  std::lock_guard<std::mutex> l(from.d_watchSlot->d_poolmut);
+  auto iter = std::find(open.begin(), open.end(), &from);
+  if(iter != open.end())
+    *iter = &to;
+  to.d_watchSlot = from.d_watchSlot;
+  to.d_site = from.d_site;
+  to.d_opened = from.d_opened;
+  to.d_txnid = from.d_txnid;
+  to.d_reported = from.d_reported;
+  from.d_watchSlot = nullptr;
+}
+
+/* Looks at the readers every so often, see MDBEnv::startReaderWatchdog(). The
+   hook is called without holding any of our locks, so it may use the
+   environment, as long as it does not stop the watchdog. */
+class MDBReaderWatchdog
+{
+public:
+  MDBReaderWatchdog(MDBEnv& env, const MDBReaderWatchdogOptions& options) : d_env(env), d_options(options)
+  {
+    if(!d_options.d_hook)
+      d_options.d_hook = [](const MDBLongReader& r) {
+        std::cerr << "lmdb-safe: RO transaction" << (r.d_site ? std::string(" from ") + r.d_site : std::string())
+                  << " has been open for " << r.d_age.count() / 1000 << "s, reading txnid " << r.d_txnid << std::endl;
+      };
+    d_thread = std::thread(&MDBReaderWatchdog::run, this);
+  }
+
+  ~MDBReaderWatchdog()
+  {
+    {
+      std::lock_guard<std::mutex> l(d_mut);
+      d_stop = true;
+    }
+    d_cv.notify_one();
+    d_thread.join();
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> l(d_mut);
+    while(!d_cv.wait_for(l, d_options.d_interval, [this]() { return d_stop; })) {
+      l.unlock();
+      try {
+        check();
+      }
+      catch(...) {
+        // a hook that throws should not take the process down
+      }
+      l.lock();
+    }
+  }
+
+  void check()
+  {
+    int dead = 0;
+    if(!mdb_reader_check(d_env.d_env, &dead) && dead > 0)
+      d_env.d_staleReaders += dead;
+
+    auto now = std::chrono::steady_clock::now();
+    std::vector<MDBLongReader> found;
+    {
+      std::lock_guard<std::mutex> l(d_env.d_slotmut);
+      for(auto& slot : d_env.d_slots) {
+        std::lock_guard<std::mutex> l2(slot->d_poolmut);
+        for(auto txn : slot->d_open) {
+          auto age = std::chrono::duration_cast<std::chrono::milliseconds>(now - txn->d_opened);
+          if(!txn->d_reported && age > d_options.d_threshold) {
+            txn->d_reported = true;
+            found.push_back({txn->d_site, age, txn->d_txnid});
+          }
+        }
+      }
+    }
+    for(const auto& r : found)
+      d_options.d_hook(r);
+  }
+
+  MDBEnv& d_env;
+  MDBReaderWatchdogOptions d_options;
+  std::thread d_thread;
+  std::mutex d_mut;
+  std::condition_variable d_cv;
+  bool d_stop{false};
+};
+
+void MDBEnv::startReaderWatchdog(const MDBReaderWatchdogOptions& options)
+{
+  std::lock_guard<std::mutex> l(d_watchdogmut);
+  d_watchdog.reset();
+  d_watchReaders = true;
+  d_watchdog.reset(new MDBReaderWatchdog(*this, options));
+}
+
+void MDBEnv::stopReaderWatchdog()
+{
+  std::lock_guard<std::mutex> l(d_watchdogmut);
+  d_watchReaders = false;
+  d_watchdog.reset();
+}
+
+// mdb_reader_list() hands us a header, and then a line per slot in use: pid, thread, and txnid or '-'
+static int readerLine(const char* line, void* ctx)
+{
+  auto stats = (MDBReaderStats*)ctx;
+  int pid;
+  size_t thread;
+  char txnid[32];
+  if(sscanf(line, "%d %zx %31s", &pid, &thread, txnid) != 3)
+    return 0;
+  ++stats->d_slotsUsed;
+  if(pid == getpid())
+    ++stats->d_slotsOurs;
+  if(txnid[0] != '-') {
+    size_t id = strtoull(txnid, nullptr, 10);
+    if(!stats->d_oldestReader || id < stats->d_oldestReader)
+      stats->d_oldestReader = id;
+  }
+  return 0;
+}
+
+MDBReaderStats MDBEnv::readerStats()
+{
+  MDBReaderStats ret;
+  MDB_envinfo info;
+  if(int rc = mdb_env_info(d_env, &info))
+    throw MDBException("getting environment info", rc);
+  ret.d_lastTxnid = info.me_last_txnid;
+  ret.d_maxReaders = info.me_maxreaders;
+  if(int rc = mdb_reader_list(d_env, readerLine, &ret))
+    throw MDBException("listing readers", rc);
+  ret.d_staleCleared = d_staleReaders;
+  ret.d_slotWaits = d_slotWaits;
+  ret.d_slotTimeouts = d_slotTimeouts;
+  ret.d_waiting = d_slotWaiters;
+  return ret;
+}
+
+/* Called when mdb_txn_begin() found all reader slots taken. The first time,
+   we free the slots of idle pooled transactions, which may be all it takes.
+   After that we wait for one of our transactions to close. Other processes
+   don't tell us when they free a slot, and a wakeup may slip by between
+   mdb_txn_begin() and our wait, so we also look again every 10ms. Returns
+   false once the deadline has passed. */
+bool MDBEnv::waitForReaderSlot(std::chrono::steady_clock::time_point& deadline)
+{
+  auto now = std::chrono::steady_clock::now();
+  if(deadline == std::chrono::steady_clock::time_point()) {
+    if(!d_readerSlotTimeout) {
+      ++d_slotTimeouts;
+      return false;
+    }
+    ++d_slotWaits;
+    deadline = now + std::chrono::milliseconds(d_readerSlotTimeout);
+    trimIdleROTransactions(true);
+    return true;
+  }
+  if(now >= deadline) {
+    ++d_slotTimeouts;
+    return false;
+  }
+
+  std::unique_lock<std::mutex> l(d_slotwaitmut);
+  ++d_slotWaiters;
+  uint64_t seen = d_slotsFreed;
+  d_slotwaitcv.wait_until(l, std::min(deadline, now + std::chrono::milliseconds(10)),
+                          [&]() { return d_slotsFreed != seen; });
+  --d_slotWaiters;
+  return true;
+}
+
+void MDBEnv::readerSlotFreedSlow()
+{
+  {
+    std::lock_guard<std::mutex> l(d_slotwaitmut);
+    ++d_slotsFreed;
+  }
+  d_slotwaitcv.notify_one();
+}
+
+MDBSnapshotState::MDBSnapshotState(MDBEnv* env, MDB_txn* txn) : d_env(env), d_txn(txn), d_txnid(mdb_txn_id(txn))
+{
+}
+
+MDBSnapshotState::~MDBSnapshotState()
+{
+  mdb_txn_abort(d_txn);
+  --d_env->d_snapshots;
+  d_env->readerSlotFreed();
+}
+
+void MDBSnapshotState::prepareSlow(MDB_dbi dbi)
+{
+  std::lock_guard<std::mutex> l(d_mut);
+  if(dbi < s_tracked && (d_ready[dbi / 64].load(std::memory_order_relaxed) & (1ULL << (dbi % 64))))
+    return;
+  // opening a cursor looks up the database, if this transaction has not done so yet
+  MDB_cursor* cursor;
+  if(int rc = mdb_cursor_open(d_txn, dbi, &cursor))
+    throw MDBException("Unable to use database in snapshot", rc);
+  mdb_cursor_close(cursor);
+  if(dbi < s_tracked)
+    d_ready[dbi / 64].fetch_or(1ULL << (dbi % 64), std::memory_order_release);
+}
+
+MDBSnapshotCursor MDBSnapshot::getCursor(const MDBDbi& dbi) const
+{
+  if(!d_state)
+    throw std::runtime_error("Attempt to use an empty snapshot for a cursor");
+  d_state->prepare(dbi);
+  MDB_cursor* cursor;
+  if(int rc = mdb_cursor_open(d_state->d_txn, dbi, &cursor))
+    throw MDBException("Error creating snapshot cursor", rc);
+  return MDBSnapshotCursor(d_state, cursor);
+}
+
+MDBSnapshot MDBEnv::getSnapshot()
+{
+  MDB_txn* txn = MDBROTransactionImpl::openROTransaction(this, nullptr);
+  // the snapshot is not this thread's, but it still holds up a resize
+  ++d_snapshots;
+  decROTX();
+  try {
+    return MDBSnapshot(std::make_shared<MDBSnapshotState>(this, txn));
+  }
+  catch(...) {
+    mdb_txn_abort(txn);
+    --d_snapshots;
+    throw;
+  }
+}
+
+MDBSnapshot MDBEnv::getSharedSnapshot()
+{
+  MDB_envinfo info;
+  mdb_env_info(d_env, &info);
+  {
+    std::lock_guard<std::mutex> l(d_sharedmut);
+    if(auto state = d_shared.lock())
+      if(state->d_txnid == info.me_last_txnid)
+        return MDBSnapshot(state);
+  }
+  auto ret = getSnapshot();
+  std::lock_guard<std::mutex> l(d_sharedmut);
+  // we may have raced another thread, the newest wins
+  auto state = d_shared.lock();
+  if(!state || state->d_txnid < ret.id())
+    d_shared = ret.d_state;
+  return ret;
+}
+
+size_t MDBEnv::durableTxnid()
+{
+  unsigned int flags;
+  mdb_env_get_flags(d_env, &flags);
+  if(flags & (MDB_NOSYNC | MDB_NOMETASYNC))
+    return d_durableTxnid;
+  MDB_envinfo info;
+  if(int rc = mdb_env_info(d_env, &info))
+    throw MDBException("getting environment info", rc);
+  return info.me_last_txnid; // LMDB syncs every commit
+}
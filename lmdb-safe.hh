@@ -11,6 +11,12 @@
 #include <mutex>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <limits>
 
 // apple compiler somehow has string_view even in c++11!
 #if __cplusplus < 201703L && !defined(__APPLE__)
@@ -40,6 +46,32 @@ The error strategy. Anything that "should never happen" turns into an exception.
   Thread safety: we are as safe as lmdb. You can talk to MDBEnv from as many threads as you want 
 */
 
+/** Thrown for LMDB errors where the caller might want to know which one it
+    was, like MDB_MAP_FULL */
+class MDBException : public std::runtime_error
+{
+public:
+  MDBException(const std::string& what, int rc) : std::runtime_error(what + ": " + mdb_strerror(rc)), d_rc(rc)
+  {}
+
+  int getRC() const
+  {
+    return d_rc;
+  }
+private:
+  int d_rc;
+};
+
+/** Throws MDBException. Out of line, so our inlined functions only carry a
+    call for their error paths, and not the building of the message */
+[[noreturn]] void throwMDBException(const char* what, int rc);
+
+//! The errors that try_put() and friends return, instead of throwing them
+inline bool isExpectedMDBError(int rc)
+{
+  return rc == MDB_KEYEXIST || rc == MDB_NOTFOUND || rc == MDB_MAP_FULL;
+}
+
 /** MDBDbi is our only 'value type' object, as 1) a dbi is actually an integer
     and 2) per LMDB documentation, we never close it. */
 class MDBDbi
@@ -62,25 +94,468 @@ public:
 class MDBRWTransactionImpl;
 class MDBROTransactionImpl;
 
-using MDBROTransaction = std::unique_ptr<MDBROTransactionImpl>;
-using MDBRWTransaction = std::unique_ptr<MDBRWTransactionImpl>;
+//! Transactions are not polymorphic, so a RO pointer to a RW transaction needs this to delete it
+struct MDBTransactionDeleter
+{
+  void operator()(MDBROTransactionImpl* txn) const;
+};
 
-class MDBEnv
+using MDBROTransaction = std::unique_ptr<MDBROTransactionImpl, MDBTransactionDeleter>;
+using MDBRWTransaction = std::unique_ptr<MDBRWTransactionImpl, MDBTransactionDeleter>;
+
+class MDBROCursor;
+class MDBWriteBatch;
+class MDBGroupCommitter;
+class MDBSyncer;
+class MDBReaderWatchdog;
+class MDBSnapshot;
+class MDBSnapshotState;
+
+/** How durable MDBRWTransactionImpl::commit(MDBDurability) makes a commit, in
+    environments opened with MDB_NOSYNC or MDB_NOMETASYNC. Elsewhere LMDB
+    syncs every commit anyhow. */
+enum class MDBDurability
+{
+  Sync,          //!< on disk when commit returns. Threads that sync at the same time share the fsync
+  AsyncDurable,  //!< commit returns right away, the future becomes ready once the commit is on disk
+  FireAndForget  //!< on disk within the lazy sync interval, unless we crash first
+};
+
+#ifndef LMDB_SAFE_METRICS
+/** Set to 1 to count operations, bytes and latencies, see MDBEnv::metrics().
+    Must be the same for lmdb-safe.cc and everything that includes us */
+#define LMDB_SAFE_METRICS 0
+#endif
+
+//! The kinds of operations MDBEnv::metrics() counts
+enum class MDBOp
+{
+  Get,      //!< get() on a transaction
+  Put,      //!< put() and try_put(), on transactions and cursors
+  Del,      //!< del(), on transactions and cursors
+  Cursor,   //!< cursor lookups and movements
+  BeginRO,  //!< opening or renewing a RO transaction
+  BeginRW,  //!< opening a RW transaction, which includes waiting for the write lock
+  Commit,   //!< committing a RW transaction
+  Abort,    //!< aborting a RW transaction
+  Max
+};
+
+/** What MDBEnv::metrics() knows about one kind of operation. To keep the
+    cost down, only one in s_sampleEvery operations is timed. Bucket n of
+    d_latency counts timed operations that took from 2^n up to 2^(n+1)
+    nanoseconds. */
+struct MDBOpMetrics
+{
+  static const unsigned int s_buckets = 40;
+  static const unsigned int s_sampleEvery = 16;
+
+  uint64_t d_count{0};
+  uint64_t d_notfound{0}; //!< how many ended in MDB_NOTFOUND
+  uint64_t d_bytes{0};    //!< of keys and values read or written
+  uint64_t d_latency[s_buckets]{};
+
+  //! How many operations were timed
+  uint64_t timed() const;
+  //! The latency in nanoseconds that a fraction q of the timed operations stayed below, rounded up to a power of 2
+  uint64_t percentile(double q) const;
+};
+
+struct MDBMetrics
+{
+  MDBOpMetrics d_ops[(int)MDBOp::Max];
+
+  const MDBOpMetrics& operator[](MDBOp op) const
+  {
+    return d_ops[(int)op];
+  }
+};
+
+/** The counters of one thread. Only that thread writes them, unless it hands
+    a transaction to another, so they are relaxed atomics that are never
+    contended, and MDBEnv::metrics() can add them up at any time. */
+struct MDBThreadMetrics
+{
+  struct Counters
+  {
+    std::atomic<uint64_t> d_count{0};
+    std::atomic<uint64_t> d_notfound{0};
+    std::atomic<uint64_t> d_bytes{0};
+    std::atomic<uint64_t> d_latency[MDBOpMetrics::s_buckets]{};
+  };
+  Counters d_ops[(int)MDBOp::Max];
+  std::atomic<unsigned int> d_tick{0};
+
+  static void bump(std::atomic<uint64_t>& counter, uint64_t n)
+  {
+    // no need for an atomic add, we are the only writer
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  bool sample()
+  {
+    unsigned int tick = d_tick.load(std::memory_order_relaxed);
+    d_tick.store(tick + 1, std::memory_order_relaxed);
+    return !(tick % MDBOpMetrics::s_sampleEvery);
+  }
+
+  //! nsec is negative for operations that were not timed
+  void record(MDBOp op, int rc, size_t bytes, int64_t nsec)
+  {
+    auto& c = d_ops[(int)op];
+    bump(c.d_count, 1);
+    if(rc == MDB_NOTFOUND)
+      bump(c.d_notfound, 1);
+    if(bytes)
+      bump(c.d_bytes, bytes);
+    if(nsec >= 0) {
+      unsigned int bucket = 0;
+      while(nsec > 1 && bucket < MDBOpMetrics::s_buckets - 1) {
+        nsec >>= 1;
+        ++bucket;
+      }
+      bump(c.d_latency[bucket], 1);
+    }
+  }
+};
+
+/** Counts and times one operation into MDBThreadMetrics. Compiles to
+    nothing without LMDB_SAFE_METRICS. */
+class MDBOpTimer
 {
 public:
-  MDBEnv(const char* fname, int flags, int mode);
+#if LMDB_SAFE_METRICS
+  MDBOpTimer(MDBThreadMetrics* metrics, MDBOp op) : d_metrics(metrics), d_op(op)
+  {
+    if(d_metrics && d_metrics->sample()) {
+      d_timed = true;
+      d_start = std::chrono::steady_clock::now();
+    }
+  }
 
-  ~MDBEnv()
+  void done(int rc, size_t bytes=0)
   {
-    //    Only a single thread may call this function. All transactions, databases, and cursors must already be closed before calling this function
-    mdb_env_close(d_env);
-    // but, elsewhere, docs say database handles do not need to be closed?
+    if(!d_metrics)
+      return;
+    int64_t nsec = -1;
+    if(d_timed)
+      nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - d_start).count();
+    d_metrics->record(d_op, rc, bytes, nsec);
   }
 
+private:
+  MDBThreadMetrics* d_metrics;
+  MDBOp d_op;
+  bool d_timed{false};
+  std::chrono::steady_clock::time_point d_start;
+#else
+  MDBOpTimer(MDBThreadMetrics*, MDBOp)
+  {}
+
+  void done(int, size_t=0)
+  {}
+#endif
+};
+
+/** What MDBEnv::writerProfile() knows about the RW transactions of one call
+    site, as passed to MDBEnv::getRWTransaction(). The write lock is held
+    from the end of d_wait until the end of d_commit. */
+struct MDBWriterSite
+{
+  std::string d_site;
+  uint64_t d_count{0};
+  uint64_t d_aborts{0}; //!< aborted, or failed to commit
+  std::chrono::nanoseconds d_wait{0};   //!< waiting for the write lock in mdb_txn_begin
+  std::chrono::nanoseconds d_hold{0};   //!< from getting the lock up to the commit or abort
+  std::chrono::nanoseconds d_commit{0}; //!< in mdb_txn_commit, including its fsync
+  std::chrono::nanoseconds d_maxHold{0}; //!< the longest a single transaction held the lock, including its commit
+
+  //! All the time this site had the write lock
+  std::chrono::nanoseconds locked() const
+  {
+    return d_hold + d_commit;
+  }
+};
+
+//! A RO transaction that the reader watchdog found open for too long
+struct MDBLongReader
+{
+  const char* d_site; //!< as passed to MDBEnv::getROTransaction(), may be nullptr
+  std::chrono::milliseconds d_age;
+  size_t d_txnid; //!< of the snapshot it reads, the pages of later ones can not be reused while it is open
+};
+
+//! For MDBEnv::startReaderWatchdog()
+struct MDBReaderWatchdogOptions
+{
+  std::chrono::milliseconds d_interval{1000}; //!< how often to look
+  std::chrono::milliseconds d_threshold{60000}; //!< readers open for longer are reported, once
+  //! called from the watchdog thread. If not set, we warn on std::cerr
+  std::function<void(const MDBLongReader&)> d_hook;
+};
+
+//! What MDBEnv::readerStats() found in the reader table, which covers all processes
+struct MDBReaderStats
+{
+  size_t d_lastTxnid{0}; //!< of the last commit
+  size_t d_oldestReader{0}; //!< snapshot of the oldest open reader, 0 if there is none
+  unsigned int d_slotsUsed{0}; //!< also counts the slots of reset transactions, like those in our pools
+  unsigned int d_slotsOurs{0}; //!< how many of d_slotsUsed this process has
+  unsigned int d_maxReaders{0};
+  uint64_t d_staleCleared{0}; //!< slots of dead processes that our watchdog cleared
+  uint64_t d_slotWaits{0}; //!< RO transactions that found all slots taken, and waited
+  uint64_t d_slotTimeouts{0}; //!< of those, how many gave up with MDB_READERS_FULL
+  unsigned int d_waiting{0}; //!< threads waiting for a slot right now
+
+  //! How many commits the oldest reader is behind. Pages freed since can not be reused
+  size_t lag() const
+  {
+    return d_oldestReader ? d_lastTxnid - d_oldestReader : 0;
+  }
+};
+
+/** Per-thread transaction bookkeeping for an MDBEnv. Every thread that uses
+    an environment gets its own slot, so opening and closing transactions never
+    touches state shared with other threads. Slots of exited threads get recycled. */
+struct MDBThreadSlot
+{
+  std::atomic<int> d_rw{0};
+  std::atomic<int> d_ro{0};
+  std::atomic<bool> d_inuse{true};
+
+  std::mutex d_poolmut; // only contended when the pool gets trimmed
+  MDB_txn* d_idle{nullptr}; // reset RO transaction, waiting to be renewed
+  std::chrono::steady_clock::time_point d_idleSince;
+  std::vector<MDB_cursor*> d_cursors; // closed RO cursors, waiting to be renewed
+  std::vector<MDBROTransactionImpl*> d_open; // with the reader watchdog on, the RO transactions opened by this thread
+  static const size_t s_maxcursors = 16;
+#if LMDB_SAFE_METRICS
+  MDBThreadMetrics d_metrics;
+#endif
+  char d_pad[64]; // keep the counters of different threads off each other's cache lines
+};
+
+/** How MDBEnv::withRWTransaction() grows the map when it runs full. The map
+    is grown by d_factor (Geometric) or by d_step bytes (FixedStep), but
+    never beyond d_ceiling, if set. */
+struct MDBGrowthPolicy
+{
+  enum class Mode { Never, Geometric, FixedStep };
+  Mode d_mode{Mode::Never};
+  double d_factor{2.0};
+  size_t d_step{0};
+  size_t d_ceiling{0};
+  // resizing needs all transactions in the process to be closed, we wait this long for that
+  std::chrono::milliseconds d_quiesceTimeout{10000};
+};
+
+/** Tunables for opening an MDBEnv. The defaults are what we always used */
+struct MDBEnvOptions
+{
+  size_t d_mapsize{16ULL*4096*244140ULL};
+  unsigned int d_maxreaders{0}; // 0 keeps the LMDB default of 126
+  unsigned int d_maxdbs{128};
+  bool d_readahead{true}; // false sets MDB_NORDAHEAD, which helps if the database is larger than RAM
+  bool d_writemap{false}; // sets MDB_WRITEMAP
+  std::string d_hotPageFile; // if set, MDBEnv::saveHotPages() to this file when the environment closes
+  unsigned int d_hotPageThreads{4}; // and restoreHotPages() from it in the background on this many threads when it opens, 0 to not
+
+  bool operator==(const MDBEnvOptions& rhs) const
+  {
+    return d_mapsize == rhs.d_mapsize && d_maxreaders == rhs.d_maxreaders && d_maxdbs == rhs.d_maxdbs &&
+      d_readahead == rhs.d_readahead && d_writemap == rhs.d_writemap && d_hotPageFile == rhs.d_hotPageFile &&
+      d_hotPageThreads == rhs.d_hotPageThreads;
+  }
+  bool operator!=(const MDBEnvOptions& rhs) const
+  {
+    return !(*this == rhs);
+  }
+};
+
+class MDBEnv
+{
+public:
+  MDBEnv(const char* fname, int flags, int mode, const MDBEnvOptions& options = MDBEnvOptions());
+
+  ~MDBEnv();
+
   MDBDbi openDB(const string_view dbname, int flags);
   
-  MDBRWTransaction getRWTransaction();
-  MDBROTransaction getROTransaction();
+  /** With setWriterProfiling() on, the transaction is accounted to 'site',
+      which should be a string that lives forever, like a literal. */
+  MDBRWTransaction getRWTransaction(const char* site=nullptr);
+  //! With the reader watchdog on, the transaction is reported under 'site', which should be a literal
+  MDBROTransaction getROTransaction(const char* site=nullptr);
+
+  /** Like getROTransaction(), getPooledROTransaction() and
+      getRWTransaction(), but the transaction is a value, which can live on
+      the stack, instead of being allocated. Handy for hot paths. */
+  MDBROTransactionImpl beginRO(const char* site=nullptr);
+  MDBROTransactionImpl beginPooledRO(const char* site=nullptr);
+  MDBRWTransactionImpl beginRW(const char* site=nullptr);
+
+  /** A read snapshot that can be copied, and used by many threads at the
+      same time, see MDBSnapshot. It takes a single reader slot, however
+      many threads use it. */
+  MDBSnapshot getSnapshot();
+
+  /** Returns the snapshot an earlier call returned, if somebody still has
+      it and nothing was committed since, or a new one otherwise. So a burst
+      of readers that only need recent data shares one reader slot. */
+  MDBSnapshot getSharedSnapshot();
+
+  /** Like getROTransaction, but reuses an MDB_txn that an earlier pooled
+      transaction of this thread left behind, through mdb_txn_reset() and
+      mdb_txn_renew(). This saves a lot of work for short read transactions.
+      While in the pool, a transaction is reset so it does not pin old pages,
+      but it does keep its reader slot, until it has been idle for longer than
+      setROPoolIdleTimeout(). */
+  MDBROTransaction getPooledROTransaction(const char* site=nullptr);
+  void setROPoolIdleTimeout(std::chrono::milliseconds timeout)
+  {
+    d_poolIdleTimeout = timeout.count();
+  }
+  //! Close pooled transactions that have been idle for too long. Happens by itself too, while the pool is in use
+  void trimROPool(bool all=false);
+
+  /** Runs func(MDBRWTransaction&) in a fresh RW transaction and commits it.
+      If that fails because the map is full, and the growth policy allows it,
+      the transaction is aborted, the map is grown and func is run again. So
+      func may run more than once, and should have no other side effects.
+      Other processes pick up the new size through MDB_MAP_RESIZED. */
+  template<typename Func>
+  void withRWTransaction(Func func, const char* site=nullptr);
+
+  void setGrowthPolicy(const MDBGrowthPolicy& policy)
+  {
+    std::lock_guard<std::mutex> l(d_growmut);
+    d_growth = policy;
+  }
+
+  /** Queues a batch of writes for the group committer. This is a thread of
+      our own, that applies as many queued batches as it can within the group
+      commit latency in one RW transaction, and then commits them together. So
+      many threads doing small writes share the cost of a commit. Each batch
+      is applied in a nested transaction, and a batch that fails is rolled
+      back on its own. The future becomes ready once the batch is committed,
+      or carries the exception that made it fail. Don't wait for it while
+      holding a RW transaction yourself, the committer needs the write lock. */
+  std::future<void> submit(MDBWriteBatch batch);
+
+  /** When all reader slots are taken, opening a RO transaction first
+      frees the slots of idle pooled transactions, and then waits this long
+      for another transaction to close, before throwing an MDBException
+      with MDB_READERS_FULL. Zero fails right away, like LMDB does. */
+  void setReaderSlotTimeout(std::chrono::milliseconds timeout)
+  {
+    d_readerSlotTimeout = timeout.count();
+  }
+
+  //! How long the group committer keeps adding batches to a transaction before committing it
+  void setGroupCommitLatency(std::chrono::microseconds latency)
+  {
+    d_groupLatency = latency.count();
+  }
+
+  //! How long commits with MDBDurability::FireAndForget may stay unsynced
+  void setLazySyncInterval(std::chrono::milliseconds interval)
+  {
+    d_lazySyncInterval = interval.count();
+  }
+
+  /** The txnid up to which commits are known to be on disk. With
+      MDB_NOSYNC or MDB_NOMETASYNC, that is as far as commit(MDBDurability)
+      got them synced, elsewhere it is the last commit. */
+  size_t durableTxnid();
+
+  /** Scans dbi on 'threads' threads. The keys are split into ranges of
+      about equal size, by interpolating between the first and the last key,
+      and the threads call func(worker, cursor, lo, hi) for one range after
+      the other. lo and hi bound the range as for MDBGenCursor::scan(lo, hi),
+      and are empty at the edges. There are several ranges per thread, so
+      unevenly spread keys still keep all threads busy. All threads see the
+      same snapshot, since their transactions are opened while we hold the
+      write lock, which is why the calling thread must not have a
+      transaction itself. In an MDB_RDONLY environment, which can not take
+      the write lock, the workers open their transactions again until they
+      all got the same one. The first exception from func ends the scan, and
+      is thrown here. */
+  void parallelScan(const MDBDbi& dbi, unsigned int threads,
+                    const std::function<void(unsigned int, MDBROCursor&, string_view, string_view)>& func);
+
+  /** Brings the used part of the data file into memory, in file order, so
+      the first queries after a restart do not all wait for page faults.
+      Works on 'threads' threads, that each advise the kernel with
+      MADV_WILLNEED about a chunk and then wait for it to be there. Stops
+      after 'budget' bytes. progress(done, total) is called as chunks come
+      in, one call at a time but from the warm-up threads. Returns the number
+      of bytes brought in. */
+  size_t warmup(size_t budget=std::numeric_limits<size_t>::max(), unsigned int threads=4,
+                const std::function<void(size_t, size_t)>& progress=std::function<void(size_t, size_t)>());
+
+  /** Like warmup() for the whole file, but only for the pages of dbi. These
+      are found by walking the keys with parallelScan(), so the branch pages
+      come in first, when looking up where the ranges start. Large values are
+      advised in full before they are touched. Has the same restrictions as
+      parallelScan(). */
+  size_t warmup(const MDBDbi& dbi, size_t budget=std::numeric_limits<size_t>::max(), unsigned int threads=4,
+                const std::function<void(size_t, size_t)>& progress=std::function<void(size_t, size_t)>());
+
+  /** Writes which pages of the data file are in memory right now, as found
+      by mincore(), to a bitmap in fname. This is a bit per page, so 3MB for
+      a 100GB map. Do this on a node that has been serving for a while, and
+      restoreHotPages() after a restart brings back its working set. Also
+      happens when we close, with MDBEnvOptions::d_hotPageFile, which is
+      then restored in the background when we open. */
+  void saveHotPages(const std::string& fname);
+
+  /** Brings the pages that saveHotPages() found in memory back in, on
+      'threads' threads, and returns once they are there. Reports progress
+      like warmup(), and returns the number of bytes brought in, which is 0
+      if there is no such file. Throws if fname is not a hot page file of
+      this machine's page size. */
+  size_t restoreHotPages(const std::string& fname, unsigned int threads=4,
+                         const std::function<void(size_t, size_t)>& progress=std::function<void(size_t, size_t)>());
+
+  /** Waits for the restore of MDBEnvOptions::d_hotPageFile that started when
+      we opened, and returns what restoreHotPages() returned, or rethrows what
+      it threw. Returns 0 if there was none, or on later calls. */
+  size_t waitForHotPages();
+
+  /** Starts or stops keeping track of how long RW transactions wait for
+      the write lock, hold it and commit, per call site. Turning it on starts
+      afresh. When off, this costs a RW transaction one atomic load. */
+  void setWriterProfiling(bool on);
+
+  /** The 'top' call sites that held the write lock the longest in total,
+      longest first. Transactions opened without a site are under
+      "(unknown)". Nested transactions are part of their parent. */
+  std::vector<MDBWriterSite> writerProfile(size_t top=10);
+
+  /** Starts a thread that looks at the readers every d_interval. It
+      reports RO transactions of ours that have been open for longer than
+      d_threshold to d_hook, since these keep the map from reusing pages. It
+      also calls mdb_reader_check() to free the reader slots of processes
+      that died. Only transactions opened while the watchdog runs are
+      watched, which costs them a lock of their thread's slot. Starting it
+      again replaces the running one. */
+  void startReaderWatchdog(const MDBReaderWatchdogOptions& options=MDBReaderWatchdogOptions());
+  void stopReaderWatchdog();
+
+  //! Reads the reader table of the environment, which is shared by all processes
+  MDBReaderStats readerStats();
+
+  /** The operations of all threads on this environment so far, added up.
+      Empty unless we were compiled with LMDB_SAFE_METRICS. */
+  MDBMetrics metrics();
+
+  size_t getMapSize();
+
+  /** Grows the map according to the growth policy, if it is still at most
+      'seen' bytes. Returns true if there is more room now. Waits for all
+      transactions in this process to close, and new ones wait for us. Fails
+      if the calling thread holds a transaction itself. */
+  bool growMap(size_t seen);
 
   operator MDB_env*& ()
   {
@@ -95,15 +570,273 @@ public:
   void incROTX();
   void decROTX();
 private:
+  MDBThreadSlot& getSlot();
+  MDBThreadSlot& getSlotSlow();
+  void waitForResize(MDBThreadSlot& slot, std::atomic<int>& counter);
+  int countTransactionsOut();
+
+  // where the operations of this thread are counted, nullptr without LMDB_SAFE_METRICS
+  MDBThreadMetrics* threadMetrics()
+  {
+#if LMDB_SAFE_METRICS
+    return &getSlot().d_metrics;
+#else
+    return nullptr;
+#endif
+  }
+
   std::mutex d_openmut;
-  std::mutex d_countmutex;
-  std::map<std::thread::id, int> d_RWtransactionsOut;
-  std::map<std::thread::id, int> d_ROtransactionsOut;
+  const uint64_t d_id; // never reused, unlike our address
+  std::mutex d_slotmut; // only taken when a thread uses us for the first time
+  std::vector<std::shared_ptr<MDBThreadSlot>> d_slots;
+  int d_orphanRW{0}, d_orphanRO{0}; // counts left behind in recycled slots
+
+  std::mutex d_growmut;
+  MDBGrowthPolicy d_growth;
+  std::atomic<bool> d_resizing{false}; // new transactions wait while this is set
+  std::mutex d_resizemut;
+  std::condition_variable d_resizecv;
+
+  friend class MDBROTransactionImpl;
+  template<class Transaction, class T> friend class MDBGenCursor;
+  void returnPooledROTransaction(MDB_txn* txn);
+  void trimIdleROTransactions(bool all);
+  MDB_txn* takePooledROTransaction();
+  MDB_cursor* takeROCursor(MDB_dbi dbi);
+  void recycleROCursor(MDB_cursor* cursor);
+  std::atomic<int64_t> d_poolIdleTimeout{1000}; // msec
+  std::atomic<int64_t> d_nextPoolTrim{0}; // steady_clock ticks
+
+  friend class MDBGroupCommitter;
+  std::once_flag d_committerOnce;
+  std::unique_ptr<MDBGroupCommitter> d_committer; // started on first submit()
+  std::atomic<int64_t> d_groupLatency{1000}; // usec
+
+  friend class MDBRWTransactionImpl;
+  friend class MDBSyncer;
+  std::future<void> afterCommit(size_t txnid, MDBDurability durability);
+  std::once_flag d_syncerOnce;
+  std::unique_ptr<MDBSyncer> d_syncer; // started on the first commit that needs it
+  std::atomic<int64_t> d_lazySyncInterval{1000}; // msec
+  std::atomic<size_t> d_durableTxnid{0}; // as far as MDBSyncer got, see durableTxnid()
+
+  std::string d_hotPageFile;
+  std::future<size_t> d_hotPageRestore; // started by the constructor, see waitForHotPages()
+  std::atomic<bool> d_closing{false}; // so the destructor need not wait for all of it
+
+  void profileWriter(MDBRWTransactionImpl& txn, const char* site, std::chrono::steady_clock::time_point start);
+  void recordWriter(const char* site, std::chrono::nanoseconds wait, std::chrono::nanoseconds hold,
+                    std::chrono::nanoseconds commit, bool aborted);
+  std::atomic<bool> d_profileWriters{false};
+  std::mutex d_profilemut;
+  std::map<std::string, MDBWriterSite> d_profile;
+
+  friend class MDBReaderWatchdog;
+  void watchReader(MDBROTransactionImpl& txn, const char* site);
+  void unwatchReader(MDBROTransactionImpl& txn);
+  void rewatchReader(MDBROTransactionImpl& from, MDBROTransactionImpl& to);
+  std::atomic<bool> d_watchReaders{false};
+  std::atomic<uint64_t> d_staleReaders{0};
+  std::mutex d_watchdogmut;
+  std::unique_ptr<MDBReaderWatchdog> d_watchdog;
+
+  // waiting for a reader slot, see setReaderSlotTimeout()
+  bool waitForReaderSlot(std::chrono::steady_clock::time_point& deadline);
+  void readerSlotFreed()
+  {
+    if(d_slotWaiters)
+      readerSlotFreedSlow();
+  }
+  void readerSlotFreedSlow();
+  std::atomic<int64_t> d_readerSlotTimeout{1000}; // msec
+  std::atomic<unsigned int> d_slotWaiters{0};
+  std::atomic<uint64_t> d_slotWaits{0}, d_slotTimeouts{0};
+  std::mutex d_slotwaitmut;
+  std::condition_variable d_slotwaitcv;
+  uint64_t d_slotsFreed{0}; // under d_slotwaitmut, so waiters can tell they missed nothing
+
+  friend class MDBSnapshotState;
+  std::atomic<int> d_snapshots{0}; // open snapshots, which belong to no thread
+  std::mutex d_sharedmut;
+  std::weak_ptr<MDBSnapshotState> d_shared; // see getSharedSnapshot()
 };
 
-std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode);
+std::shared_ptr<MDBEnv> getMDBEnv(const char* fname, int flags, int mode, const MDBEnvOptions& options = MDBEnvOptions());
+
 
 
+#ifndef LMDB_SAFE_INLINE_SIZE
+//! The largest type MDBInVal stores in itself, instead of pointing to memory of the caller
+#define LMDB_SAFE_INLINE_SIZE 16
+#endif
+
+/** Wraps a number, std::chrono::duration or std::chrono::time_point so it is
+    stored big-endian with the sign flipped, which the default LMDB comparator
+    sorts numerically. Meant for keys in databases without MDB_INTEGERKEY,
+    where native integers sort by their lowest byte first. */
+template<typename T>
+struct MDBOrdered
+{
+  MDBOrdered() = default;
+  MDBOrdered(T value) : d_value(value)
+  {}
+
+  operator T() const
+  {
+    return d_value;
+  }
+
+  T d_value;
+};
+
+struct MDBOutVal;
+class MDBInVal;
+
+// if all bytes of a T are part of its value, so it has no padding
+#if __cplusplus >= 201703L
+#define LMDB_SAFE_NO_PADDING(T) std::has_unique_object_representations<T>::value
+#elif defined(__has_builtin)
+#if __has_builtin(__has_unique_object_representations)
+#define LMDB_SAFE_NO_PADDING(T) __has_unique_object_representations(T)
+#endif
+#endif
+#ifndef LMDB_SAFE_NO_PADDING
+#define LMDB_SAFE_NO_PADDING(T) false // we can't tell, so classes have to opt in
+#endif
+
+/** Types that MDBCodec stores as they are in memory. Classes only if they
+    have no padding, since padding bytes are indeterminate, and equal keys
+    would not compare equal. The compiler also can't vouch for classes with
+    floating point members, specialize this to std::true_type for those
+    that you know have no padding. */
+template<typename T>
+struct MDBIsPlain : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value ||
+                                           (std::is_class<T>::value && std::is_trivially_copyable<T>::value &&
+                                            LMDB_SAFE_NO_PADDING(T))>
+{};
+template<> struct MDBIsPlain<string_view> : std::false_type {};
+template<> struct MDBIsPlain<MDB_val> : std::false_type {};
+template<> struct MDBIsPlain<MDBOutVal> : std::false_type {};
+template<> struct MDBIsPlain<MDBInVal> : std::false_type {};
+template<typename T> struct MDBIsPlain<MDBOrdered<T>> : std::false_type {};
+
+/** How MDBInVal and MDBOutVal encode a type of fixed size. Numbers, enums and
+    trivially copyable classes without padding are stored as they are in memory, MDBOrdered
+    types so that they sort. To store another type, specialize this with
+    'enabled', 'size', encode(const T&, char*) and decode(const char*). */
+template<typename T, typename Enable=void>
+struct MDBCodec
+{
+  static const bool enabled = false;
+};
+
+template<typename T>
+struct MDBCodec<T, typename std::enable_if<MDBIsPlain<T>::value>::type>
+{
+  static const bool enabled = true;
+  static const size_t size = sizeof(T);
+  static void encode(const T& t, char* dest)
+  {
+    memcpy(dest, &t, sizeof(T));
+  }
+  static T decode(const char* src)
+  {
+    T ret;
+    memcpy(&ret, src, sizeof(T));
+    return ret;
+  }
+};
+
+template<typename U>
+inline void MDBWriteBigEndian(U u, char* dest)
+{
+  for(size_t n = sizeof(U); n--; u >>= 8)
+    dest[n] = (char)(u & 0xff);
+}
+
+template<typename U>
+inline U MDBReadBigEndian(const char* src)
+{
+  U u = 0;
+  for(size_t n = 0; n < sizeof(U); ++n)
+    u = (U)((u << 8) | (unsigned char)src[n]);
+  return u;
+}
+
+template<typename T>
+struct MDBCodec<MDBOrdered<T>, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+{
+  typedef typename std::make_unsigned<T>::type U;
+  static const U s_flip = std::is_signed<T>::value ? (U)((U)1 << (8*sizeof(U) - 1)) : 0; // negative numbers sort first
+
+  static const bool enabled = true;
+  static const size_t size = sizeof(T);
+  static void encode(const MDBOrdered<T>& t, char* dest)
+  {
+    MDBWriteBigEndian<U>((U)t.d_value ^ s_flip, dest);
+  }
+  static MDBOrdered<T> decode(const char* src)
+  {
+    return (T)(MDBReadBigEndian<U>(src) ^ s_flip);
+  }
+};
+
+template<typename T>
+struct MDBCodec<MDBOrdered<T>, typename std::enable_if<std::is_floating_point<T>::value && (sizeof(T) == 4 || sizeof(T) == 8)>::type>
+{
+  typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type U;
+  static const U s_sign = (U)1 << (8*sizeof(U) - 1);
+
+  static const bool enabled = true;
+  static const size_t size = sizeof(T);
+  // IEEE 754 sorts like sign and magnitude, so we invert negative numbers and put positive ones after them
+  static void encode(const MDBOrdered<T>& t, char* dest)
+  {
+    U u;
+    memcpy(&u, &t.d_value, sizeof(u));
+    MDBWriteBigEndian<U>((u & s_sign) ? ~u : (u | s_sign), dest);
+  }
+  static MDBOrdered<T> decode(const char* src)
+  {
+    U u = MDBReadBigEndian<U>(src);
+    u = (u & s_sign) ? (u & ~s_sign) : ~u;
+    T ret;
+    memcpy(&ret, &u, sizeof(ret));
+    return ret;
+  }
+};
+
+template<typename Rep, typename Period>
+struct MDBCodec<MDBOrdered<std::chrono::duration<Rep, Period>>>
+{
+  typedef std::chrono::duration<Rep, Period> T;
+  static const bool enabled = true;
+  static const size_t size = MDBCodec<MDBOrdered<Rep>>::size;
+  static void encode(const MDBOrdered<T>& t, char* dest)
+  {
+    MDBCodec<MDBOrdered<Rep>>::encode(t.d_value.count(), dest);
+  }
+  static MDBOrdered<T> decode(const char* src)
+  {
+    return T(MDBCodec<MDBOrdered<Rep>>::decode(src).d_value);
+  }
+};
+
+template<typename Clock, typename Duration>
+struct MDBCodec<MDBOrdered<std::chrono::time_point<Clock, Duration>>>
+{
+  typedef std::chrono::time_point<Clock, Duration> T;
+  static const bool enabled = true;
+  static const size_t size = MDBCodec<MDBOrdered<Duration>>::size;
+  static void encode(const MDBOrdered<T>& t, char* dest)
+  {
+    MDBCodec<MDBOrdered<Duration>>::encode(t.d_value.time_since_epoch(), dest);
+  }
+  static MDBOrdered<T> decode(const char* src)
+  {
+    return T(MDBCodec<MDBOrdered<Duration>>::decode(src).d_value);
+  }
+};
 
 struct MDBOutVal
 {
@@ -112,21 +845,19 @@ struct MDBOutVal
     return d_mdbval;
   }
 
+  //! Anything with an MDBCodec, like numbers and MDBOrdered types
   template <class T,
-          typename std::enable_if<std::is_arithmetic<T>::value,
-                                  T>::type* = nullptr> const
-  T get()
+            typename std::enable_if<MDBCodec<T>::enabled, T>::type* = nullptr>
+  T get() const
   {
-    T ret;
-    if(d_mdbval.mv_size != sizeof(T))
+    if(d_mdbval.mv_size != MDBCodec<T>::size)
       throw std::runtime_error("MDB data has wrong length for type");
-    
-    memcpy(&ret, d_mdbval.mv_data, sizeof(T));
-    return ret;
+
+    return MDBCodec<T>::decode((const char*)d_mdbval.mv_data);
   }
 
   template <class T,
-            typename std::enable_if<std::is_class<T>::value,T>::type* = nullptr>
+            typename std::enable_if<std::is_class<T>::value && !MDBCodec<T>::enabled, T>::type* = nullptr>
   T get() const;
 
   template<class T>
@@ -171,14 +902,32 @@ public:
     d_mdbval = rhs.d_mdbval;
   }
 
+  // an encoded value lives in d_memory, so a copy has to point to its own
+  MDBInVal(const MDBInVal& rhs)
+  {
+    *this = rhs;
+  }
+
+  MDBInVal& operator=(const MDBInVal& rhs)
+  {
+    d_mdbval = rhs.d_mdbval;
+    if(rhs.d_mdbval.mv_data == rhs.d_memory) {
+      memcpy(d_memory, rhs.d_memory, rhs.d_mdbval.mv_size);
+      d_mdbval.mv_data = d_memory;
+    }
+    return *this;
+  }
+
+  /** Anything with an MDBCodec is encoded into our own memory, so this
+      never allocates and never points to a temporary of the caller */
   template <class T,
-            typename std::enable_if<std::is_arithmetic<T>::value,
-                                    T>::type* = nullptr>
-  MDBInVal(T i) 
+            typename std::enable_if<MDBCodec<T>::enabled, T>::type* = nullptr>
+  MDBInVal(const T& t)
   {
-    memcpy(&d_memory[0], &i, sizeof(i));
-    d_mdbval.mv_size = sizeof(T);
-    d_mdbval.mv_data = d_memory;;
+    static_assert(MDBCodec<T>::size <= sizeof(d_memory), "type too large to store inline, raise LMDB_SAFE_INLINE_SIZE or use MDBInVal::fromStruct");
+    MDBCodec<T>::encode(t, d_memory);
+    d_mdbval.mv_size = MDBCodec<T>::size;
+    d_mdbval.mv_data = d_memory;
   }
 
   MDBInVal(const char* s)
@@ -216,91 +965,453 @@ public:
   MDB_val d_mdbval;
 private:
   MDBInVal(){}
-  char d_memory[sizeof(double)];
+  char d_memory[LMDB_SAFE_INLINE_SIZE];
 
 };
 
+/** A view on an array of T, like C++20 std::span. Used for pages of
+    MDB_DUPFIXED duplicates, which are arrays of fixed-size items. */
+template<typename T>
+class MDBSpan
+{
+public:
+  MDBSpan() : d_data(nullptr), d_size(0)
+  {}
+  MDBSpan(T* data, size_t size) : d_data(data), d_size(size)
+  {}
+  template<typename U, typename std::enable_if<std::is_convertible<U*, T*>::value, U>::type* = nullptr>
+  MDBSpan(std::vector<U>& v) : d_data(v.data()), d_size(v.size())
+  {}
+  template<typename U, typename std::enable_if<std::is_convertible<const U*, T*>::value, U>::type* = nullptr>
+  MDBSpan(const std::vector<U>& v) : d_data(v.data()), d_size(v.size())
+  {}
+
+  T* data() const
+  {
+    return d_data;
+  }
+  size_t size() const
+  {
+    return d_size;
+  }
+  bool empty() const
+  {
+    return !d_size;
+  }
+  T& operator[](size_t n) const
+  {
+    return d_data[n];
+  }
+  T* begin() const
+  {
+    return d_data;
+  }
+  T* end() const
+  {
+    return d_data + d_size;
+  }
+
+private:
+  T* d_data;
+  size_t d_size;
+};
+
+/** Writes to be applied atomically by MDBEnv::submit(). Keys and values are
+    copied in, so the batch does not point to memory of the caller. */
+class MDBWriteBatch
+{
+public:
+  void put(MDB_dbi dbi, const MDBInVal& key, const MDBInVal& val, int flags=0)
+  {
+    d_ops.push_back({Op::Type::Put, dbi, flags, toString(key), toString(val)});
+  }
+
+  void del(MDB_dbi dbi, const MDBInVal& key)
+  {
+    d_ops.push_back({Op::Type::Del, dbi, 0, toString(key), std::string()});
+  }
+
+  //! For MDB_DUPSORT databases, deletes only this value
+  void del(MDB_dbi dbi, const MDBInVal& key, const MDBInVal& val)
+  {
+    d_ops.push_back({Op::Type::DelValue, dbi, 0, toString(key), toString(val)});
+  }
+
+  size_t size() const
+  {
+    return d_ops.size();
+  }
+
+  bool empty() const
+  {
+    return d_ops.empty();
+  }
+
+  //! Performs the writes in txn, throws on the first that fails. Deleting what is not there is not a failure.
+  void apply(MDBRWTransactionImpl& txn) const;
+
+private:
+  static std::string toString(const MDBInVal& v)
+  {
+    return std::string((const char*)v.d_mdbval.mv_data, v.d_mdbval.mv_size);
+  }
+
+  struct Op
+  {
+    enum class Type { Put, Del, DelValue };
+    Type d_type;
+    MDB_dbi d_dbi;
+    int d_flags;
+    std::string d_key, d_val;
+  };
+  std::vector<Op> d_ops;
+};
+
 
 
 
 class MDBROCursor;
 
+/** The cursors that are open within a transaction, so we can close them when
+    it ends. This is an intrusive list running through the cursors themselves,
+    so opening, moving and closing a cursor takes constant time and never
+    allocates. */
+template<class T>
+struct MDBCursorList
+{
+  T* d_head{nullptr};
+  MDBEnv* d_recycler{nullptr}; // if set, closed cursors go back to this MDBEnv for mdb_cursor_renew()
+  size_t d_writes{0}; // RW only: bumped by every write in the transaction or its cursors, see MDBReservation
+  MDBThreadMetrics* d_metrics{nullptr}; // with LMDB_SAFE_METRICS, where the transaction and its cursors count their operations
+
+  //! For moving a transaction: takes over everything of src, and points its cursors to us
+  void take(MDBCursorList& src)
+  {
+    *this = src;
+    for(T* cursor = d_head; cursor; cursor = cursor->d_next)
+      cursor->d_registry = this;
+    src.d_head = nullptr;
+  }
+};
+
+/** A RO transaction, or the RO part of a RW one. There are no virtual
+    methods, commit() and abort() go by d_rw to reach the RW versions. It
+    can live on the stack, see MDBEnv::beginRO(), and be moved, which takes
+    its cursors along. A RW transaction can not be moved into a RO one,
+    since that would cut it off from its RW half. */
 class MDBROTransactionImpl
 {
 protected:
   MDBROTransactionImpl(MDBEnv *parent, MDB_txn *txn);
+  MDBROTransactionImpl() : d_parent(nullptr), d_txn(nullptr) {} // to move into
+  void takeFrom(MDBROTransactionImpl& src);
 
 private:
   static MDB_txn *openROTransaction(MDBEnv *env, MDB_txn *parent, int flags=0);
+  void finish(bool commit); // the RO half of commit() and abort()
 
   MDBEnv* d_parent;
-  std::vector<MDBROCursor*> d_cursors;
+  bool d_pooled{false}; // d_txn goes back to the pool of d_parent when we are done
+
+protected:
+  bool d_rw{false}; // we are the base of an MDBRWTransactionImpl
+
+private:
+
+  // set while the reader watchdog watches us, see MDBEnv::startReaderWatchdog()
+  MDBThreadSlot* d_watchSlot{nullptr};
+  const char* d_site{nullptr};
+  std::chrono::steady_clock::time_point d_opened;
+  size_t d_txnid{0};
+  bool d_reported{false};
+
+  friend class MDBEnv;
+  friend class MDBReaderWatchdog;
+  friend struct MDBTransactionDeleter;
 
 protected:
   MDB_txn* d_txn;
+  MDBCursorList<MDBROCursor> d_cursors;
+
+  void closeROCursors();
+
+public:
+  explicit MDBROTransactionImpl(MDBEnv* parent, int flags=0);
+
+  MDBROTransactionImpl(const MDBROTransactionImpl& src) = delete;
+  MDBROTransactionImpl &operator=(const MDBROTransactionImpl& src) = delete;
+
+  // these throw if rhs is RW, which would get sliced
+  MDBROTransactionImpl(MDBROTransactionImpl&& rhs);
+  MDBROTransactionImpl &operator=(MDBROTransactionImpl &&rhs);
+
+  ~MDBROTransactionImpl();
+
+  void abort();
+  void commit();
+
+  int get(MDB_dbi dbi, const MDBInVal& key, MDBOutVal& val)
+  {
+    if(!d_txn)
+      throw std::runtime_error("Attempt to use a closed RO transaction for get");
+
+    MDBOpTimer timer(d_cursors.d_metrics, MDBOp::Get);
+    int rc = mdb_get(d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval),
+                     const_cast<MDB_val*>(&val.d_mdbval));
+    if(rc && rc != MDB_NOTFOUND)
+      throwMDBException("getting data", rc);
+    timer.done(rc, rc ? 0 : val.d_mdbval.mv_size);
+    return rc;
+  }
+
+  int get(MDB_dbi dbi, const MDBInVal& key, string_view& val)
+  {
+    MDBOutVal out;
+    int rc = get(dbi, key, out);
+    if(!rc)
+      val = out.get<string_view>();
+    return rc;
+  }
+
+  /** Looks up all keys, and puts views of their values in vals[], in the
+      order of keys. A key that is not there gets a string_view with a
+      nullptr data(). Returns how many keys were found.
+
+      Instead of descending the tree for every key, like get() does, this
+      visits the keys in the order of the database with a single cursor,
+      so keys that are near each other are found by stepping to the next
+      entry. Pass 'sorted' if keys already are in database order, to skip
+      sorting them. They then really must be, or keys will not be found. */
+  size_t getMany(MDB_dbi dbi, MDBSpan<const string_view> keys, string_view* vals, bool sorted=false);
+
+  size_t getMany(MDB_dbi dbi, const std::vector<string_view>& keys, std::vector<string_view>& vals, bool sorted=false)
+  {
+    vals.resize(keys.size());
+    return getMany(dbi, MDBSpan<const string_view>(keys), vals.data(), sorted);
+  }
+
+  // this is something you can do, readonly
+  MDBDbi openDB(string_view dbname, int flags)
+  {
+    return MDBDbi( d_parent->d_env, d_txn, dbname, flags);
+  }
+
+  MDBROCursor getCursor(const MDBDbi&);
+  MDBROCursor getROCursor(const MDBDbi&);
+    
+  operator MDB_txn*()
+  {
+    return d_txn;
+  }
+
+  inline operator bool() const {
+    return d_txn;
+  }
+
+  inline MDBEnv &environment()
+  {
+    return *d_parent;
+  }
+};
+
+/** Gets a page of MDB_DUPFIXED duplicates with MDB_GET_MULTIPLE or
+    MDB_NEXT_MULTIPLE. The span points into the map, so it is valid as long
+    as the data would be. */
+template<typename T>
+inline int MDBGetMultiple(MDB_cursor* cursor, MDB_val& key, MDBSpan<const T>& values, MDB_cursor_op op)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "duplicates can only be viewed as trivially copyable types");
+  MDB_val data;
+  int rc = mdb_cursor_get(cursor, &key, &data, op);
+  if(rc) {
+    if(rc != MDB_NOTFOUND)
+      throwMDBException("Unable to get multiple from cursor", rc);
+    values = MDBSpan<const T>();
+    return rc;
+  }
+  if(data.mv_size % sizeof(T))
+    throw std::runtime_error("MDB data has wrong length for type");
+  values = MDBSpan<const T>((const T*)data.mv_data, data.mv_size / sizeof(T));
+  return 0;
+}
+
+/** Walks the duplicates of a key in an MDB_DUPFIXED database a page at a
+    time, see MDBGenCursor::dupPages(). Dereferencing gives an
+    MDBSpan<const T> of up to a page of values. */
+template<typename T>
+class MDBDupPageIterator
+{
+public:
+  MDBDupPageIterator() : d_cursor(nullptr)
+  {}
+  MDBDupPageIterator(MDB_cursor* cursor, const MDBSpan<const T>& first) : d_cursor(cursor), d_page(first)
+  {}
+
+  const MDBSpan<const T>& operator*() const
+  {
+    return d_page;
+  }
+  const MDBSpan<const T>* operator->() const
+  {
+    return &d_page;
+  }
 
-  void closeROCursors();
+  MDBDupPageIterator& operator++()
+  {
+    MDB_val key;
+    if(MDBGetMultiple(d_cursor, key, d_page, MDB_NEXT_MULTIPLE))
+      d_cursor = nullptr; // that was the last page of this key
+    return *this;
+  }
 
-public:
-  explicit MDBROTransactionImpl(MDBEnv* parent, int flags=0);
+  bool operator==(const MDBDupPageIterator& rhs) const
+  {
+    return d_cursor == rhs.d_cursor;
+  }
+  bool operator!=(const MDBDupPageIterator& rhs) const
+  {
+    return d_cursor != rhs.d_cursor;
+  }
 
-  MDBROTransactionImpl(const MDBROTransactionImpl& src) = delete;
-  MDBROTransactionImpl &operator=(const MDBROTransactionImpl& src) = delete;
+private:
+  MDB_cursor* d_cursor; // nullptr once we are done
+  MDBSpan<const T> d_page;
+};
 
-  // The move constructor/operator cannot be made safe due to Object Slicing with MDBRWTransaction.
-  MDBROTransactionImpl(MDBROTransactionImpl&& rhs) = delete;
-  MDBROTransactionImpl &operator=(MDBROTransactionImpl &&rhs) = delete;
+template<typename T>
+struct MDBDupPages
+{
+  MDBDupPageIterator<T> begin() const
+  {
+    return d_begin;
+  }
+  MDBDupPageIterator<T> end() const
+  {
+    return MDBDupPageIterator<T>();
+  }
+  MDBDupPageIterator<T> d_begin;
+};
 
-  virtual ~MDBROTransactionImpl();
+//! If key starts with prefix, without copying either
+inline bool MDBHasPrefix(const MDB_val& key, string_view prefix)
+{
+  return key.mv_size >= prefix.size() && !memcmp(key.mv_data, prefix.data(), prefix.size());
+}
 
-  virtual void abort();
-  virtual void commit();
+/** Walks a cursor over a range of keys, see MDBGenCursor::scan(), and yields
+    string_view pairs of key and value straight from the map. Bounds are
+    compared with mdb_cmp(), so they follow the order of the database, also
+    with MDB_INTEGERKEY, MDB_REVERSEKEY or a comparator from
+    mdb_set_compare(). Prefixes are matched byte for byte. */
+class MDBScanIterator
+{
+public:
+  enum class Limit { None, Below, AtLeast, Prefix };
+
+  MDBScanIterator() : d_cursor(nullptr)
+  {}
+  MDBScanIterator(MDB_cursor* cursor, MDB_cursor_op step, Limit limit, const MDB_val& bound,
+                  MDBThreadMetrics* metrics=nullptr) :
+    d_cursor(cursor), d_txn(mdb_cursor_txn(cursor)), d_dbi(mdb_cursor_dbi(cursor)),
+    d_step(step), d_limit(limit), d_bound(bound), d_metrics(metrics)
+  {}
+
+  //! Positions with op, stays at the end if that finds nothing in range
+  void start(MDB_cursor_op op, MDB_val key)
+  {
+    d_key = key;
+    get(op);
+  }
 
-  int get(MDB_dbi dbi, const MDBInVal& key, MDBOutVal& val)
+  std::pair<string_view, string_view> operator*() const
   {
-    if(!d_txn)
-      throw std::runtime_error("Attempt to use a closed RO transaction for get");
+    return std::make_pair(string_view((const char*)d_key.mv_data, d_key.mv_size),
+                          string_view((const char*)d_val.mv_data, d_val.mv_size));
+  }
 
-    int rc = mdb_get(d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval),
-                     const_cast<MDB_val*>(&val.d_mdbval));
-    if(rc && rc != MDB_NOTFOUND)
-      throw std::runtime_error("getting data: " + std::string(mdb_strerror(rc)));
-    
-    return rc;
+  MDBScanIterator& operator++()
+  {
+    get(d_step);
+    return *this;
   }
 
-  int get(MDB_dbi dbi, const MDBInVal& key, string_view& val)
+  bool operator==(const MDBScanIterator& rhs) const
   {
-    MDBOutVal out;
-    int rc = get(dbi, key, out);
-    if(!rc)
-      val = out.get<string_view>();
-    return rc;
+    return d_cursor == rhs.d_cursor;
+  }
+  bool operator!=(const MDBScanIterator& rhs) const
+  {
+    return d_cursor != rhs.d_cursor;
   }
 
-  
-  // this is something you can do, readonly
-  MDBDbi openDB(string_view dbname, int flags)
+  const MDB_val& key() const
   {
-    return MDBDbi( d_parent->d_env, d_txn, dbname, flags);
+    return d_key;
+  }
+  const MDB_val& val() const
+  {
+    return d_val;
   }
 
-  MDBROCursor getCursor(const MDBDbi&);
-  MDBROCursor getROCursor(const MDBDbi&);
-    
-  operator MDB_txn*()
+private:
+  void get(MDB_cursor_op op)
   {
-    return d_txn;
+    MDBOpTimer timer(d_metrics, MDBOp::Cursor);
+    int rc = mdb_cursor_get(d_cursor, &d_key, &d_val, op);
+    if(rc && rc != MDB_NOTFOUND)
+      throwMDBException("Unable to scan from cursor", rc);
+    timer.done(rc, rc ? 0 : d_key.mv_size + d_val.mv_size);
+    if(rc || !inside())
+      d_cursor = nullptr;
   }
 
-  inline operator bool() const {
-    return d_txn;
+  bool inside() const
+  {
+    switch(d_limit) {
+    case Limit::None:
+      return true;
+    case Limit::Below:
+      return mdb_cmp(d_txn, d_dbi, &d_key, &d_bound) < 0;
+    case Limit::AtLeast:
+      return mdb_cmp(d_txn, d_dbi, &d_key, &d_bound) >= 0;
+    case Limit::Prefix:
+      return MDBHasPrefix(d_key, string_view((const char*)d_bound.mv_data, d_bound.mv_size));
+    }
+    return false;
   }
 
-  inline MDBEnv &environment()
+  MDB_cursor* d_cursor; // nullptr once we are done
+  MDB_txn* d_txn;
+  MDB_dbi d_dbi;
+  MDB_cursor_op d_step;
+  Limit d_limit;
+  MDB_val d_bound;
+  MDBThreadMetrics* d_metrics; // every step counts as an MDBOp::Cursor
+  MDB_val d_key, d_val;
+};
+
+/** A range of keys to walk with a cursor, made by MDBGenCursor::scan() and
+    friends. begin() positions the cursor, so a cursor can only walk one
+    range at a time. The bounds are not copied, and must outlive the range. */
+class MDBScanRange
+{
+public:
+  MDBScanRange(MDB_cursor* cursor, bool reverse, string_view lo, string_view hi, bool prefix,
+               MDBThreadMetrics* metrics=nullptr);
+
+  MDBScanIterator begin() const;
+  MDBScanIterator end() const
   {
-    return *d_parent;
+    return MDBScanIterator();
   }
+
+private:
+  MDB_cursor* d_cursor;
+  bool d_reverse;
+  bool d_prefix;
+  bool d_bounded;
+  MDB_val d_lo, d_hi;
+  MDBThreadMetrics* d_metrics;
 };
 
 /* 
@@ -313,62 +1424,100 @@ template<class Transaction, class T>
 class MDBGenCursor
 {
 private:
-  std::vector<T*> *d_registry;
+  MDBCursorList<T> *d_registry;
   MDB_cursor* d_cursor;
+  T *d_prev, *d_next; // our neighbours in d_registry
+  friend struct MDBCursorList<T>;
 
 public:
   MDBGenCursor():
     d_registry(nullptr),
-    d_cursor(nullptr)
+    d_cursor(nullptr),
+    d_prev(nullptr),
+    d_next(nullptr)
   {
 
   }
 
-  MDBGenCursor(std::vector<T*> &registry, MDB_cursor *cursor):
+  //! A cursor that no transaction knows about, and that closes itself
+  explicit MDBGenCursor(MDB_cursor *cursor):
+    d_registry(nullptr),
+    d_cursor(cursor),
+    d_prev(nullptr),
+    d_next(nullptr)
+  {
+  }
+
+  MDBGenCursor(MDBCursorList<T> &registry, MDB_cursor *cursor):
     d_registry(&registry),
-    d_cursor(cursor)
+    d_cursor(cursor),
+    d_prev(nullptr),
+    d_next(registry.d_head)
+  {
+    if (d_next) {
+      base(d_next)->d_prev = static_cast<T*>(this);
+    }
+    registry.d_head = static_cast<T*>(this);
+  }
+
+protected:
+  // a write through this cursor moves data around, so reservations in the transaction become invalid
+  void noteWrite()
+  {
+    if (d_registry) {
+      ++d_registry->d_writes;
+    }
+  }
+
+  MDBThreadMetrics* metrics() const
   {
-    registry.emplace_back(static_cast<T*>(this));
+    return d_registry ? d_registry->d_metrics : nullptr;
   }
 
 private:
-  void move_from(MDBGenCursor *src)
+  static MDBGenCursor* base(T* cursor)
   {
-    if (!d_registry) {
-      return;
-    }
+    return cursor;
+  }
 
-    auto iter = std::find(d_registry->begin(),
-                          d_registry->end(),
-                          src);
-    if (iter != d_registry->end()) {
-      *iter = static_cast<T*>(this);
-    } else {
-      d_registry->emplace_back(static_cast<T*>(this));
+  // take the place of src in its registry
+  void move_from(MDBGenCursor *src)
+  {
+    d_registry = src->d_registry;
+    d_cursor = src->d_cursor;
+    d_prev = src->d_prev;
+    d_next = src->d_next;
+    if (d_registry) {
+      if (d_prev) {
+        base(d_prev)->d_next = static_cast<T*>(this);
+      } else {
+        d_registry->d_head = static_cast<T*>(this);
+      }
+      if (d_next) {
+        base(d_next)->d_prev = static_cast<T*>(this);
+      }
     }
+    src->d_registry = nullptr;
+    src->d_cursor = nullptr;
+    src->d_prev = src->d_next = nullptr;
   }
 
 public:
   MDBGenCursor(const MDBGenCursor &src) = delete;
 
-  MDBGenCursor(MDBGenCursor &&src) noexcept:
-    d_registry(src.d_registry),
-    d_cursor(src.d_cursor)
+  MDBGenCursor(MDBGenCursor &&src) noexcept
   {
     move_from(&src);
-    src.d_registry = nullptr;
-    src.d_cursor = nullptr;
   }
 
   MDBGenCursor &operator=(const MDBGenCursor &src) = delete;
 
   MDBGenCursor &operator=(MDBGenCursor &&src) noexcept
   {
-    d_registry = src.d_registry;
-    d_cursor = src.d_cursor;
-    move_from(&src);
-    src.d_registry = nullptr;
-    src.d_cursor = nullptr;
+    if (this != &src) {
+      close();
+      move_from(&src);
+    }
     return *this;
   }
 
@@ -380,18 +1529,22 @@ public:
 public:
   int get(MDBOutVal& key, MDBOutVal& data, MDB_cursor_op op)
   {
+    MDBOpTimer timer(metrics(), MDBOp::Cursor);
     int rc = mdb_cursor_get(d_cursor, &key.d_mdbval, &data.d_mdbval, op);
     if(rc && rc != MDB_NOTFOUND)
-       throw std::runtime_error("Unable to get from cursor: " + std::string(mdb_strerror(rc)));
+       throwMDBException("Unable to get from cursor", rc);
+    timer.done(rc, rc ? 0 : key.d_mdbval.mv_size + data.d_mdbval.mv_size);
     return rc;
   }
 
   int find(const MDBInVal& in, MDBOutVal& key, MDBOutVal& data)
   {
     key.d_mdbval = in.d_mdbval;
+    MDBOpTimer timer(metrics(), MDBOp::Cursor);
     int rc=mdb_cursor_get(d_cursor, const_cast<MDB_val*>(&key.d_mdbval), &data.d_mdbval, MDB_SET);
     if(rc && rc != MDB_NOTFOUND)
-       throw std::runtime_error("Unable to find from cursor: " + std::string(mdb_strerror(rc)));
+       throwMDBException("Unable to find from cursor", rc);
+    timer.done(rc, rc ? 0 : key.d_mdbval.mv_size + data.d_mdbval.mv_size);
     return rc;
   }
   
@@ -399,18 +1552,22 @@ public:
   {
     key.d_mdbval = in.d_mdbval;
 
+    MDBOpTimer timer(metrics(), MDBOp::Cursor);
     int rc = mdb_cursor_get(d_cursor, const_cast<MDB_val*>(&key.d_mdbval), &data.d_mdbval, MDB_SET_RANGE);
     if(rc && rc != MDB_NOTFOUND)
-       throw std::runtime_error("Unable to lower_bound from cursor: " + std::string(mdb_strerror(rc)));
+       throwMDBException("Unable to lower_bound from cursor", rc);
+    timer.done(rc, rc ? 0 : key.d_mdbval.mv_size + data.d_mdbval.mv_size);
     return rc;
   }
 
   
   int nextprev(MDBOutVal& key, MDBOutVal& data, MDB_cursor_op op)
   {
+    MDBOpTimer timer(metrics(), MDBOp::Cursor);
     int rc = mdb_cursor_get(d_cursor, const_cast<MDB_val*>(&key.d_mdbval), &data.d_mdbval, op);
     if(rc && rc != MDB_NOTFOUND)
-       throw std::runtime_error("Unable to prevnext from cursor: " + std::string(mdb_strerror(rc)));
+       throwMDBException("Unable to prevnext from cursor", rc);
+    timer.done(rc, rc ? 0 : key.d_mdbval.mv_size + data.d_mdbval.mv_size);
     return rc;
   }
 
@@ -426,9 +1583,11 @@ public:
 
   int currentlast(MDBOutVal& key, MDBOutVal& data, MDB_cursor_op op)
   {
+    MDBOpTimer timer(metrics(), MDBOp::Cursor);
     int rc = mdb_cursor_get(d_cursor, const_cast<MDB_val*>(&key.d_mdbval), &data.d_mdbval, op);
     if(rc && rc != MDB_NOTFOUND)
-       throw std::runtime_error("Unable to next from cursor: " + std::string(mdb_strerror(rc)));
+       throwMDBException("Unable to next from cursor", rc);
+    timer.done(rc, rc ? 0 : key.d_mdbval.mv_size + data.d_mdbval.mv_size);
     return rc;
   }
 
@@ -436,6 +1595,123 @@ public:
   {
     return currentlast(key, data, MDB_GET_CURRENT);
   }
+
+  /** All keys, in order:
+
+        for(const auto& kv : cursor.scan())
+          cout << kv.first << " = " << kv.second << endl;
+
+      Keys and values are string_views onto the map. */
+  MDBScanRange scan()
+  {
+    return MDBScanRange(d_cursor, false, string_view(), string_view(), false, metrics());
+  }
+
+  //! The keys from lo, up to but not including hi. An empty hi means there is no upper limit
+  MDBScanRange scan(string_view lo, string_view hi)
+  {
+    return MDBScanRange(d_cursor, false, lo, hi, false, metrics());
+  }
+
+  /** The keys that start with prefix, byte for byte. Those are only next to
+      each other in databases that are in byte order, which is the default.
+      Throws for MDB_INTEGERKEY and MDB_REVERSEKEY, and is meaningless with
+      a comparator from mdb_set_compare(). */
+  MDBScanRange scanPrefix(string_view prefix)
+  {
+    return MDBScanRange(d_cursor, false, prefix, string_view(), true, metrics());
+  }
+
+  //! All keys, from the last to the first
+  MDBScanRange scanReverse()
+  {
+    return MDBScanRange(d_cursor, true, string_view(), string_view(), false, metrics());
+  }
+
+  //! The keys from lo up to but not including hi, from the last to the first
+  MDBScanRange scanReverse(string_view lo, string_view hi)
+  {
+    return MDBScanRange(d_cursor, true, lo, hi, false, metrics());
+  }
+
+  /** Fetches up to n entries with op, and puts views of them onto the map in
+      keys[] and vals[], either of which may be nullptr. Returns how many it
+      got, fewer than n only at the end. This lets callers work on whole
+      arrays at a time, instead of calling us for every row:
+
+        string_view keys[256], vals[256];
+        while(size_t count = cursor.scanBatch(256, keys, vals))
+          for(size_t n = 0; n < count; ++n)
+            ...
+
+      A cursor that is not positioned yet starts at the first entry with
+      MDB_NEXT, and at the last with MDB_PREV. */
+  size_t scanBatch(size_t n, string_view* keys, string_view* vals, MDB_cursor_op op=MDB_NEXT)
+  {
+    MDB_val key, data;
+    size_t count = 0;
+    for(; count < n; ++count) {
+      MDBOpTimer timer(metrics(), MDBOp::Cursor);
+      int rc = mdb_cursor_get(d_cursor, &key, &data, op);
+      if(rc && rc != MDB_NOTFOUND)
+        throwMDBException("Unable to scan batch from cursor", rc);
+      timer.done(rc, rc ? 0 : key.mv_size + data.mv_size);
+      if(rc)
+        break;
+      if(keys)
+        keys[count] = string_view((const char*)key.mv_data, key.mv_size);
+      if(vals)
+        vals[count] = string_view((const char*)data.mv_data, data.mv_size);
+    }
+    return count;
+  }
+
+  /** For MDB_DUPFIXED databases: the page of duplicates at our position,
+      from where we are on. Moves to the last value of that page, for
+      nextMultiple(). Returns MDB_NOTFOUND if there are none. */
+  template<typename V>
+  int getMultiple(MDBSpan<const V>& values)
+  {
+    MDB_val key;
+    return MDBGetMultiple(d_cursor, key, values, MDB_GET_MULTIPLE);
+  }
+
+  /** For MDB_DUPFIXED databases: the next page of duplicates of the current
+      key. Returns MDB_NOTFOUND once they are all done. If we were not
+      positioned yet, starts with the first key. */
+  template<typename V>
+  int nextMultiple(MDBOutVal& key, MDBSpan<const V>& values)
+  {
+    return MDBGetMultiple(d_cursor, key.d_mdbval, values, MDB_NEXT_MULTIPLE);
+  }
+
+  /** For MDB_DUPFIXED databases: all duplicates of key, a page at a time,
+      which is a lot faster than one by one:
+
+        for(const auto& page : cursor.dupPages<uint32_t>(key))
+          for(auto id : page)
+            ...
+
+      The cursor is used for the walk, so it can not do anything else
+      meanwhile. Empty if the key is not there. */
+  template<typename V>
+  MDBDupPages<V> dupPages(const MDBInVal& key)
+  {
+    MDB_val k = key.d_mdbval, data;
+    MDBDupPages<V> ret;
+    int rc = mdb_cursor_get(d_cursor, &k, &data, MDB_SET);
+    if(rc == MDB_NOTFOUND)
+      return ret;
+    if(rc)
+      throwMDBException("Unable to find from cursor", rc);
+    if(data.mv_size != sizeof(V))
+      throw std::runtime_error("MDB data has wrong length for type");
+
+    MDBSpan<const V> first;
+    if(!getMultiple(first))
+      ret.d_begin = MDBDupPageIterator<V>(d_cursor, first);
+    return ret;
+  }
   int last(MDBOutVal& key, MDBOutVal& data)
   {
     return currentlast(key, data, MDB_LAST);
@@ -457,17 +1733,25 @@ public:
 
   void close()
   {
+    MDBEnv* recycler = d_registry ? d_registry->d_recycler : nullptr;
     if (d_registry) {
-      auto iter = std::find(d_registry->begin(),
-                            d_registry->end(),
-                            static_cast<T*>(this));
-      if (iter != d_registry->end()) {
-        d_registry->erase(iter);
+      if (d_prev) {
+        base(d_prev)->d_next = d_next;
+      } else {
+        d_registry->d_head = d_next;
+      }
+      if (d_next) {
+        base(d_next)->d_prev = d_prev;
       }
       d_registry = nullptr;
+      d_prev = d_next = nullptr;
     }
     if (d_cursor) {
-      mdb_cursor_close(d_cursor);
+      if (recycler) {
+        recycler->recycleROCursor(d_cursor);
+      } else {
+        mdb_cursor_close(d_cursor);
+      }
       d_cursor = nullptr;
     }
   }
@@ -486,8 +1770,177 @@ public:
 
 };
 
+/** The RO transaction behind MDBSnapshot, aborted when the last handle or
+    cursor lets go of it. With MDB_NOTLS, LMDB lets many threads read
+    through one RO transaction, except that the first use of a named
+    database in a transaction updates it. prepare() does that first use
+    under a lock. */
+class MDBSnapshotState
+{
+public:
+  MDBSnapshotState(MDBEnv* env, MDB_txn* txn);
+  ~MDBSnapshotState();
+  MDBSnapshotState(const MDBSnapshotState&) = delete;
+  MDBSnapshotState& operator=(const MDBSnapshotState&) = delete;
+
+  //! Call before using dbi in d_txn
+  void prepare(MDB_dbi dbi)
+  {
+    if(dbi < s_tracked && (d_ready[dbi / 64].load(std::memory_order_acquire) & (1ULL << (dbi % 64))))
+      return;
+    prepareSlow(dbi);
+  }
+
+  MDBEnv* d_env;
+  MDB_txn* d_txn;
+  size_t d_txnid;
+
+private:
+  void prepareSlow(MDB_dbi dbi);
+
+  static const MDB_dbi s_tracked = 256; // databases beyond this always take the lock
+  std::atomic<uint64_t> d_ready[s_tracked / 64]{};
+  std::mutex d_mut;
+};
+
+//! A cursor in an MDBSnapshot, which keeps the snapshot open while it lives
+class MDBSnapshotCursor : public MDBROCursor
+{
+public:
+  MDBSnapshotCursor() = default;
+  MDBSnapshotCursor(std::shared_ptr<MDBSnapshotState> state, MDB_cursor* cursor) :
+    MDBROCursor(cursor), d_state(std::move(state))
+  {}
+  MDBSnapshotCursor(MDBSnapshotCursor&& src) = default;
+  MDBSnapshotCursor& operator=(MDBSnapshotCursor&& src) = default;
+
+private:
+  // RO cursors may be closed after their transaction, so it is fine that this goes first
+  std::shared_ptr<MDBSnapshotState> d_state;
+};
+
+/** A read snapshot that, unlike MDBROTransaction, can be copied and shared
+    between threads, which may all use it at the same time. Every copy sees
+    the same data, and all of them together take one reader slot. Cursors
+    from getCursor() are for one thread at a time, like all cursors. The
+    snapshot stays open until the last copy and the last of its cursors are
+    gone. */
+class MDBSnapshot
+{
+public:
+  MDBSnapshot() = default;
+
+  explicit operator bool() const
+  {
+    return !!d_state;
+  }
+
+  //! The txnid of the commit this snapshot shows
+  size_t id() const
+  {
+    return d_state ? d_state->d_txnid : 0;
+  }
+
+  int get(MDB_dbi dbi, const MDBInVal& key, MDBOutVal& val) const
+  {
+    if(!d_state)
+      throw std::runtime_error("Attempt to use an empty snapshot for get");
+    d_state->prepare(dbi);
+    int rc = mdb_get(d_state->d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval),
+                     const_cast<MDB_val*>(&val.d_mdbval));
+    if(rc && rc != MDB_NOTFOUND)
+      throwMDBException("getting data", rc);
+    return rc;
+  }
+
+  int get(MDB_dbi dbi, const MDBInVal& key, string_view& val) const
+  {
+    MDBOutVal out;
+    int rc = get(dbi, key, out);
+    if(!rc)
+      val = out.get<string_view>();
+    return rc;
+  }
+
+  MDBSnapshotCursor getCursor(const MDBDbi& dbi) const;
+
+  //! For calling LMDB directly, mind prepare() in MDBSnapshotState
+  operator MDB_txn*() const
+  {
+    return d_state ? d_state->d_txn : nullptr;
+  }
+
+private:
+  friend class MDBEnv;
+  explicit MDBSnapshot(std::shared_ptr<MDBSnapshotState> state) : d_state(std::move(state))
+  {}
+
+  std::shared_ptr<MDBSnapshotState> d_state;
+};
+
 class MDBRWCursor;
 
+// the loop of MDBPutMultiple, for 'count' items of 'size' bytes
+size_t MDBPutMultipleRaw(MDB_cursor* cursor, const MDB_val& key, const char* values, size_t size, size_t count, int flags);
+
+/** Stores values as duplicates of key through a cursor with MDB_MULTIPLE,
+    see MDBRWTransactionImpl::putMultiple(). With 'sort', sorts a copy of the
+    values in the order of the database and drops repeats first. */
+template<typename T>
+size_t MDBPutMultiple(MDB_cursor* cursor, const MDBInVal& key, MDBSpan<const T> values, int flags, bool sort)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be stored as DUPFIXED values");
+  if(!sort)
+    return MDBPutMultipleRaw(cursor, key.d_mdbval, (const char*)values.data(), sizeof(T), values.size(), flags);
+
+  MDB_txn* txn = mdb_cursor_txn(cursor);
+  MDB_dbi dbi = mdb_cursor_dbi(cursor);
+  auto cmp = [txn, dbi](const T& a, const T& b) {
+    MDB_val va{sizeof(T), (void*)&a}, vb{sizeof(T), (void*)&b};
+    return mdb_dcmp(txn, dbi, &va, &vb);
+  };
+  std::vector<T> sorted(values.begin(), values.end());
+  std::sort(sorted.begin(), sorted.end(), [&cmp](const T& a, const T& b) { return cmp(a, b) < 0; });
+  sorted.erase(std::unique(sorted.begin(), sorted.end(), [&cmp](const T& a, const T& b) { return !cmp(a, b); }),
+               sorted.end());
+  return MDBPutMultipleRaw(cursor, key.d_mdbval, (const char*)sorted.data(), sizeof(T), sorted.size(), flags);
+}
+
+/** Memory in the map that MDBRWTransactionImpl::reserve() set aside for a
+    value, which you can write the value into. LMDB may move it around on
+    the next write, so after any other write in the transaction or its
+    cursors, or after its commit or abort, data() throws. Must not outlive
+    the transaction object, nor be used after that object is moved. */
+class MDBReservation
+{
+public:
+  MDBReservation(char* data, size_t size, const size_t* writes) : d_data(data), d_size(size), d_writes(writes), d_seen(*writes)
+  {}
+
+  char* data() const
+  {
+    if(!valid())
+      throw std::runtime_error("Attempt to use a reservation after a later write in its transaction");
+    return d_data;
+  }
+
+  size_t size() const
+  {
+    return d_size;
+  }
+
+  bool valid() const
+  {
+    return *d_writes == d_seen;
+  }
+
+private:
+  char* d_data;
+  size_t d_size;
+  const size_t* d_writes;
+  size_t d_seen;
+};
+
 class MDBRWTransactionImpl: public MDBROTransactionImpl
 {
 protected:
@@ -497,7 +1950,16 @@ private:
   static MDB_txn *openRWTransaction(MDBEnv* env, MDB_txn *parent, int flags);
 
 private:
-  std::vector<MDBRWCursor*> d_rw_cursors;
+  MDBCursorList<MDBRWCursor> d_rw_cursors;
+  bool d_child{false}; // nested in another RW transaction
+
+  // for MDBEnv::setWriterProfiling()
+  friend class MDBEnv;
+  bool d_profiled{false};
+  const char* d_site{nullptr};
+  std::chrono::nanoseconds d_wait{0};
+  std::chrono::steady_clock::time_point d_locked;
+  void profileEnd(std::chrono::nanoseconds commit, bool aborted);
 
   void closeRWCursors();
   inline void closeRORWCursors() {
@@ -509,44 +1971,106 @@ public:
   explicit MDBRWTransactionImpl(MDBEnv* parent, int flags=0);
 
   MDBRWTransactionImpl(const MDBRWTransactionImpl& rhs) = delete;
-  MDBRWTransactionImpl(MDBRWTransactionImpl&& rhs) = delete;
   MDBRWTransactionImpl &operator=(const MDBRWTransactionImpl& rhs) = delete;
-  MDBRWTransactionImpl &operator=(MDBRWTransactionImpl&& rhs) = delete;
+  //! Reservations of rhs are not valid in the new transaction, see MDBReservation
+  MDBRWTransactionImpl(MDBRWTransactionImpl&& rhs);
+  MDBRWTransactionImpl &operator=(MDBRWTransactionImpl&& rhs);
 
-  ~MDBRWTransactionImpl() override;
+  ~MDBRWTransactionImpl();
   
-  void commit() override;
-  void abort() override;
+  void commit();
+  void abort();
+
+  /** Commits, and then makes the commit as durable as asked, see
+      MDBDurability. The future is ready at once, except for AsyncDurable,
+      where it carries the exception if the sync fails. A failed Sync throws
+      here, with the transaction committed. A nested transaction gets
+      durable with its parent, so for those this is just commit(). */
+  std::future<void> commit(MDBDurability durability);
 
   void clear(MDB_dbi dbi);
   
   void put(MDB_dbi dbi, const MDBInVal& key, const MDBInVal& val, int flags=0)
+  {
+    if(int rc = try_put(dbi, key, val, flags))
+      throwMDBException("putting data", rc);
+  }
+
+  /** Like put, but returns MDB_KEYEXIST, MDB_NOTFOUND and MDB_MAP_FULL
+      instead of throwing them, so a workload that expects these does not pay
+      for exceptions. Anything else still throws. */
+  int try_put(MDB_dbi dbi, const MDBInVal& key, const MDBInVal& val, int flags=0)
   {
     if(!d_txn)
       throw std::runtime_error("Attempt to use a closed RW transaction for put");
-    int rc;
-    if((rc=mdb_put(d_txn, dbi,
-                   const_cast<MDB_val*>(&key.d_mdbval),
-                   const_cast<MDB_val*>(&val.d_mdbval), flags)))
-      throw std::runtime_error("putting data: " + std::string(mdb_strerror(rc)));
+    MDB_val data = val.d_mdbval; // with MDB_KEYEXIST, LMDB points this to what is there
+    ++d_rw_cursors.d_writes;
+    MDBOpTimer timer(d_rw_cursors.d_metrics, MDBOp::Put);
+    int rc = mdb_put(d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval), &data, flags);
+    if(rc && !isExpectedMDBError(rc))
+      throwMDBException("putting data", rc);
+    timer.done(rc, key.d_mdbval.mv_size + val.d_mdbval.mv_size);
+    return rc;
+  }
+
+  //! Puts only if the key is not there yet, returns MDB_KEYEXIST if it is
+  int insert(MDB_dbi dbi, const MDBInVal& key, const MDBInVal& val)
+  {
+    return try_put(dbi, key, val, MDB_NOOVERWRITE);
+  }
+
+  /** Makes room for a value of 'size' bytes under key with MDB_RESERVE, so
+      you can write the value straight into the map, instead of building it
+      elsewhere and having LMDB copy it. The reservation is usable until the
+      next write in this transaction, see MDBReservation. Not for MDB_DUPSORT
+      databases. */
+  MDBReservation reserve(MDB_dbi dbi, const MDBInVal& key, size_t size, int flags=0);
+
+  /** Stores all values as duplicates of key in an MDB_DUPFIXED database,
+      with MDB_MULTIPLE, which is a lot faster than a put per value. With
+      'sort', the values are first sorted in the order of the database and
+      repeats are dropped, which also makes LMDB's work sequential. Returns
+      how many values were stored. With MDB_NODUPDATA, values that were there
+      already are skipped, and not counted. */
+  template<typename T>
+  size_t putMultiple(MDB_dbi dbi, const MDBInVal& key, MDBSpan<const T> values, int flags=0, bool sort=false);
+
+  template<typename T>
+  size_t putMultiple(MDB_dbi dbi, const MDBInVal& key, const std::vector<T>& values, int flags=0, bool sort=false)
+  {
+    return putMultiple(dbi, key, MDBSpan<const T>(values), flags, sort);
+  }
+
+  //! Reserves 'size' bytes for key, and has fill(char*, size_t) write the value into them
+  template<typename Func>
+  void putReserved(MDB_dbi dbi, const MDBInVal& key, size_t size, Func fill, int flags=0)
+  {
+    auto reservation = reserve(dbi, key, size, flags);
+    fill(reservation.data(), reservation.size());
   }
 
 
   int del(MDBDbi& dbi, const MDBInVal& key, const MDBInVal& val)
   {
     int rc;
+    ++d_rw_cursors.d_writes;
+    MDBOpTimer timer(d_rw_cursors.d_metrics, MDBOp::Del);
     rc=mdb_del(d_txn, dbi, (MDB_val*)&key.d_mdbval, (MDB_val*)&val.d_mdbval);
     if(rc && rc != MDB_NOTFOUND)
-      throw std::runtime_error("deleting data: " + std::string(mdb_strerror(rc)));
+      throw MDBException("deleting data", rc);
+    timer.done(rc, key.d_mdbval.mv_size + val.d_mdbval.mv_size);
     return rc;
   }
 
   int del(MDBDbi& dbi, const MDBInVal& key)
   {
     int rc;
+    ++d_rw_cursors.d_writes;
+    MDBOpTimer timer(d_rw_cursors.d_metrics, MDBOp::Del);
     rc=mdb_del(d_txn, dbi, (MDB_val*)&key.d_mdbval, 0);
     if(rc && rc != MDB_NOTFOUND)
-      throw std::runtime_error("deleting data: " + std::string(mdb_strerror(rc)));
+      throw MDBException("deleting data", rc);
+    timer.done(rc, key.d_mdbval.mv_size);
     return rc;
   }
 
@@ -556,10 +2080,12 @@ public:
     if(!d_txn)
       throw std::runtime_error("Attempt to use a closed RW transaction for get");
 
+    MDBOpTimer timer(d_cursors.d_metrics, MDBOp::Get);
     int rc = mdb_get(d_txn, dbi, const_cast<MDB_val*>(&key.d_mdbval),
                      const_cast<MDB_val*>(&val.d_mdbval));
     if(rc && rc != MDB_NOTFOUND)
-      throw std::runtime_error("getting data: " + std::string(mdb_strerror(rc)));
+      throwMDBException("getting data", rc);
+    timer.done(rc, rc ? 0 : val.d_mdbval.mv_size);
     return rc;
   }
 
@@ -582,6 +2108,11 @@ public:
 
   MDBRWTransaction getRWTransaction();
   MDBROTransaction getROTransaction();
+  //! A nested transaction, as a value like MDBEnv::beginRW()
+  MDBRWTransactionImpl beginRW();
+
+private:
+  MDB_txn* openChild();
 };
 
 /* "A cursor in a write-transaction can be closed before its transaction ends, and will otherwise be closed when its transaction ends" 
@@ -600,26 +2131,98 @@ public:
 
   void put(const MDBOutVal& key, const MDBInVal& data)
   {
+    noteWrite();
+    MDBOpTimer timer(metrics(), MDBOp::Put);
     int rc = mdb_cursor_put(*this,
                             const_cast<MDB_val*>(&key.d_mdbval),
                             const_cast<MDB_val*>(&data.d_mdbval), MDB_CURRENT);
     if(rc)
-      throw std::runtime_error("mdb_cursor_put: " + std::string(mdb_strerror(rc)));
+      throwMDBException("mdb_cursor_put", rc);
+    timer.done(rc, key.d_mdbval.mv_size + data.d_mdbval.mv_size);
   }
 
-  
+  //! Returns MDB_KEYEXIST, MDB_NOTFOUND and MDB_MAP_FULL, throws for other errors
   int put(const MDBOutVal& key, const MDBOutVal& data, int flags=0)
   {
-    // XXX check errors
-    return mdb_cursor_put(*this,
-                          const_cast<MDB_val*>(&key.d_mdbval),
-                          const_cast<MDB_val*>(&data.d_mdbval), flags);
+    return try_put(key, data, flags);
+  }
+
+  /** Like MDBRWTransactionImpl::try_put, through this cursor. Returns
+      MDB_KEYEXIST, MDB_NOTFOUND and MDB_MAP_FULL, throws for other errors */
+  int try_put(const MDBInVal& key, const MDBInVal& data, int flags=0)
+  {
+    MDB_val val = data.d_mdbval;
+    noteWrite();
+    MDBOpTimer timer(metrics(), MDBOp::Put);
+    int rc = mdb_cursor_put(*this, const_cast<MDB_val*>(&key.d_mdbval), &val, flags);
+    if(rc && !isExpectedMDBError(rc))
+      throwMDBException("mdb_cursor_put", rc);
+    timer.done(rc, key.d_mdbval.mv_size + data.d_mdbval.mv_size);
+    return rc;
+  }
+
+  //! Like MDBRWTransactionImpl::putMultiple(), through this cursor
+  template<typename T>
+  size_t putMultiple(const MDBInVal& key, MDBSpan<const T> values, int flags=0, bool sort=false)
+  {
+    noteWrite();
+    return MDBPutMultiple(*this, key, values, flags, sort);
+  }
+
+  template<typename T>
+  size_t putMultiple(const MDBInVal& key, const std::vector<T>& values, int flags=0, bool sort=false)
+  {
+    return putMultiple(key, MDBSpan<const T>(values), flags, sort);
   }
 
   int del(int flags=0)
   {
-    return mdb_cursor_del(*this, flags);
+    noteWrite();
+    MDBOpTimer timer(metrics(), MDBOp::Del);
+    int rc = mdb_cursor_del(*this, flags);
+    timer.done(rc);
+    return rc;
   }
 
 };
 
+template<typename T>
+size_t MDBRWTransactionImpl::putMultiple(MDB_dbi dbi, const MDBInVal& key, MDBSpan<const T> values, int flags, bool sort)
+{
+  if(!d_txn)
+    throw std::runtime_error("Attempt to use a closed RW transaction for putMultiple");
+  ++d_rw_cursors.d_writes;
+
+  // mdb_put does not do MDB_MULTIPLE
+  MDB_cursor* cursor;
+  if(int rc = mdb_cursor_open(d_txn, dbi, &cursor))
+    throw MDBException("Error creating RW cursor", rc);
+  try {
+    size_t ret = MDBPutMultiple(cursor, key, values, flags, sort);
+    mdb_cursor_close(cursor);
+    return ret;
+  }
+  catch(...) {
+    mdb_cursor_close(cursor);
+    throw;
+  }
+}
+
+template<typename Func>
+void MDBEnv::withRWTransaction(Func func, const char* site)
+{
+  for(;;) {
+    size_t seen = getMapSize();
+    try {
+      auto txn = getRWTransaction(site);
+      func(txn);
+      txn->commit();
+      return;
+    }
+    catch(const MDBException& e) {
+      // txn has been aborted by now
+      if(e.getRC() != MDB_MAP_FULL || !growMap(seen))
+        throw;
+    }
+  }
+}
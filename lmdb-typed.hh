@@ -357,7 +357,7 @@ public:
         else if(rc) {
           throw std::runtime_error("in genoperator, " + std::string(mdb_strerror(rc)));
         }
-        else if(!d_prefix.empty() && d_key.get<std::string>().rfind(d_prefix, 0)!=0) {
+        else if(!d_prefix.empty() && !MDBHasPrefix(d_key.d_mdbval, d_prefix)) {
           d_end = true;
         }
         else {
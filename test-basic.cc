@@ -1,6 +1,7 @@
 #define CATCH_CONFIG_MAIN
 
 #include <iostream>
+#include <sys/wait.h>
 #include "catch2/catch.hpp"
 #include "lmdb-safe.hh"
 
@@ -327,3 +328,1416 @@ TEST_CASE("transaction counter correctness for RW->RO nesting")
   CHECK_NOTHROW(env.getRWTransaction());
   CHECK_NOTHROW(env.getROTransaction());
 }
+
+TEST_CASE("transaction counters are per thread")
+{
+  unlink("./tests");
+
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+
+  auto txn = env.getRWTransaction();
+  txn->put(main, "bert", "hubert");
+  txn->commit();
+
+  auto rotxn = env.getROTransaction();
+  CHECK_THROWS_AS(env.getRWTransaction(), std::runtime_error);
+
+  // churn through threads, which should neither see our RO transaction nor leave anything behind
+  for(int round = 0; round < 4; ++round) {
+    std::vector<std::thread> threads;
+    std::atomic<int> failures{0};
+    for(int n = 0; n < 8; ++n) {
+      threads.emplace_back([&]() {
+          try {
+            auto ro = env.getROTransaction();
+            MDBOutVal out;
+            if(ro->get(main, "bert", out))
+              ++failures;
+          }
+          catch(std::exception& e) {
+            ++failures;
+          }
+        });
+    }
+    for(auto& t : threads)
+      t.join();
+    CHECK(failures == 0);
+  }
+
+  bool wrote = false;
+  std::thread writer([&]() {
+      auto rwtxn = env.getRWTransaction();
+      wrote = true;
+    });
+  writer.join();
+  CHECK(wrote);
+
+  rotxn->commit();
+  CHECK_NOTHROW(env.getRWTransaction());
+}
+
+TEST_CASE("pooled RO transactions")
+{
+  unlink("./tests");
+
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+
+  MDBOutVal out;
+  {
+    auto rotxn = env.getPooledROTransaction();
+    CHECK(rotxn->get(main, "bert", out) == MDB_NOTFOUND);
+  }
+
+  {
+    auto txn = env.getRWTransaction();
+    txn->put(main, "bert", "hubert");
+    CHECK_THROWS_AS(env.getPooledROTransaction(), std::runtime_error);
+    txn->commit();
+  }
+
+  // the renewed transaction must see the new data
+  for(int n = 0; n < 3; ++n) {
+    auto rotxn = env.getPooledROTransaction();
+    REQUIRE(rotxn->get(main, "bert", out) == 0);
+    CHECK(out.get<std::string>() == "hubert");
+    auto second = env.getPooledROTransaction();
+    CHECK(second->get(main, "bert", out) == 0);
+  }
+
+  env.setROPoolIdleTimeout(std::chrono::milliseconds(0));
+  {
+    auto rotxn = env.getPooledROTransaction();
+  }
+  env.trimROPool();
+  CHECK_NOTHROW(env.getRWTransaction());
+}
+
+TEST_CASE("many cursors in one transaction")
+{
+  unlink("./tests");
+
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+
+  auto txn = env.getRWTransaction();
+  txn->put(main, "bert", "hubert");
+
+  std::vector<MDBRWCursor> cursors;
+  for(int n = 0; n < 500; ++n)
+    cursors.push_back(txn->getRWCursor(main)); // vector growth moves them all around
+
+  // close every other one, and move-assign over some of the others
+  for(size_t n = 0; n < cursors.size(); n += 2)
+    cursors[n].close();
+  for(size_t n = 1; n + 2 < cursors.size(); n += 4)
+    cursors[n] = std::move(cursors[n + 2]);
+
+  size_t open = 0;
+  for(auto& c : cursors) {
+    if(c) {
+      MDBOutVal key, val;
+      CHECK(c.get(key, val, MDB_FIRST) == 0);
+      ++open;
+    }
+  }
+  CHECK(open == 125);
+
+  txn->commit();
+  for(auto& c : cursors)
+    CHECK(!c);
+}
+
+TEST_CASE("RO cursors get renewed across transactions")
+{
+  unlink("./tests");
+
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+  MDBDbi other = env.openDB("other", MDB_CREATE);
+
+  std::set<MDB_cursor*> seen; // the cursors of the first round, which later rounds should get back
+  for(int n = 0; n < 5; ++n) {
+    {
+      auto txn = env.getRWTransaction();
+      txn->put(main, "counter", n);
+      txn->put(other, "counter", -n);
+      txn->commit();
+    }
+
+    auto rotxn = n % 2 ? env.getPooledROTransaction() : env.getROTransaction();
+    auto cursor = rotxn->getCursor(main);
+    auto cursor2 = rotxn->getCursor(other);
+    auto cursor3 = rotxn->getCursor(main);
+    MDBOutVal key, val;
+    REQUIRE(cursor.get(key, val, MDB_FIRST) == 0);
+    CHECK(val.get<int>() == n);
+    REQUIRE(cursor2.get(key, val, MDB_FIRST) == 0);
+    CHECK(val.get<int>() == -n);
+    REQUIRE(cursor3.find("counter", key, val) == 0);
+    CHECK(val.get<int>() == n);
+    for(MDB_cursor* c : {(MDB_cursor*)cursor, (MDB_cursor*)cursor2, (MDB_cursor*)cursor3}) {
+      if(!n)
+        seen.insert(c);
+      else
+        CHECK(seen.count(c) == 1);
+    }
+    cursor2.close();
+    // cursor and cursor3 get closed, and cached, by the transaction
+  }
+
+  // an RO cursor in an RW transaction must not end up in the cache
+  {
+    auto txn = env.getRWTransaction();
+    auto cursor = txn->getROCursor(main);
+    MDBOutVal key, val;
+    CHECK(cursor.get(key, val, MDB_FIRST) == 0);
+    txn->abort();
+  }
+  auto rotxn = env.getROTransaction();
+  auto cursor = rotxn->getCursor(main);
+  CHECK(seen.count(cursor) == 1);
+  MDBOutVal key, val;
+  CHECK(cursor.get(key, val, MDB_FIRST) == 0);
+}
+
+TEST_CASE("growing the map when it is full", "[growth]")
+{
+  unlink("./tests");
+
+  MDBEnvOptions options;
+  options.d_mapsize = 1024*1024;
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+
+  std::string value(1000, 'x');
+  auto fill = [&](MDBRWTransaction& txn) {
+    for(int n = 0; n < 5000; ++n)
+      txn->put(main, n, value);
+  };
+
+  try {
+    env.withRWTransaction(fill);
+    FAIL("map did not fill up");
+  }
+  catch(const MDBException& e) {
+    CHECK(e.getRC() == MDB_MAP_FULL);
+  }
+
+  MDBGrowthPolicy policy;
+  policy.d_mode = MDBGrowthPolicy::Mode::Geometric;
+  policy.d_ceiling = 2*1024*1024;
+  env.setGrowthPolicy(policy);
+  CHECK_THROWS_AS(env.withRWTransaction(fill), MDBException);
+  CHECK(env.getMapSize() == 2*1024*1024);
+
+  policy.d_ceiling = 0;
+  env.setGrowthPolicy(policy);
+
+  // readers in other threads have to get out of the way, new ones wait for the resize
+  std::atomic<bool> stop{false};
+  std::atomic<int> reads{0};
+  std::vector<std::thread> readers;
+  for(int n = 0; n < 4; ++n) {
+    readers.emplace_back([&]() {
+        while(!stop) {
+          auto rotxn = env.getROTransaction();
+          MDBOutVal out;
+          rotxn->get(main, 0, out);
+          ++reads;
+        }
+      });
+  }
+
+  int runs = 0;
+  env.withRWTransaction([&](MDBRWTransaction& txn) {
+      ++runs;
+      fill(txn);
+    });
+  stop = true;
+  for(auto& t : readers)
+    t.join();
+
+  CHECK(runs > 1);
+  CHECK(env.getMapSize() >= 4*1024*1024);
+  auto rotxn = env.getROTransaction();
+  MDBOutVal out;
+  REQUIRE(rotxn->get(main, 4999, out) == 0);
+  CHECK(out.get<std::string>() == value);
+
+  // we can't grow while holding a transaction ourselves
+  CHECK(!env.growMap(env.getMapSize()));
+}
+
+TEST_CASE("environment options", "[options]")
+{
+  unlink("./tests");
+
+  MDBEnvOptions options;
+  options.d_mapsize = 64*1024*1024;
+  options.d_maxreaders = 300;
+  options.d_maxdbs = 2;
+  options.d_readahead = false;
+
+  auto env = getMDBEnv("./tests", MDB_NOSUBDIR, 0600, options);
+  CHECK(env->getMapSize() == 64*1024*1024);
+  unsigned int maxreaders;
+  REQUIRE(mdb_env_get_maxreaders(*env, &maxreaders) == 0);
+  CHECK(maxreaders == 300);
+  unsigned int flags;
+  REQUIRE(mdb_env_get_flags(*env, &flags) == 0);
+  CHECK((flags & MDB_NORDAHEAD));
+
+  env->openDB("one", MDB_CREATE);
+  env->openDB("two", MDB_CREATE);
+  CHECK_THROWS_AS(env->openDB("three", MDB_CREATE), std::runtime_error);
+
+  CHECK(getMDBEnv("./tests", MDB_NOSUBDIR, 0600, options) == env);
+  CHECK_THROWS_AS(getMDBEnv("./tests", MDB_NOSUBDIR, 0600), std::runtime_error);
+  options.d_maxreaders = 200;
+  CHECK_THROWS_AS(getMDBEnv("./tests", MDB_NOSUBDIR, 0600, options), std::runtime_error);
+}
+
+TEST_CASE("group commit", "[groupcommit]")
+{
+  unlink("./tests");
+
+  for(int writemap = 0; writemap < 2; ++writemap) {
+    MDBEnvOptions options;
+    options.d_writemap = writemap;
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+    MDBDbi main = env.openDB("", MDB_CREATE);
+    {
+      auto txn = env.getRWTransaction();
+      txn->clear(main);
+      txn->put(main, "taken", "already");
+      txn->commit();
+    }
+
+    // many threads, each with a stream of small batches
+    std::atomic<int> failures{0};
+    std::vector<std::thread> writers;
+    for(int t = 0; t < 8; ++t) {
+      writers.emplace_back([&, t]() {
+          std::vector<std::future<void>> results;
+          for(int n = 0; n < 100; ++n) {
+            MDBWriteBatch batch;
+            batch.put(main, t * 1000 + n, n);
+            batch.put(main, t * 1000 + n + 500, n);
+            results.push_back(env.submit(std::move(batch)));
+          }
+          for(auto& r : results) {
+            try {
+              r.get();
+            }
+            catch(...) {
+              ++failures;
+            }
+          }
+        });
+    }
+
+    // a batch that fails halfway does not leave anything behind, nor take others down with it
+    MDBWriteBatch bad;
+    bad.put(main, "new", "value");
+    bad.put(main, "taken", "again", MDB_NOOVERWRITE);
+    auto badres = env.submit(std::move(bad));
+
+    for(auto& w : writers)
+      w.join();
+    try {
+      badres.get();
+      FAIL("batch with duplicate key was committed");
+    }
+    catch(const MDBException& e) {
+      CHECK(e.getRC() == MDB_KEYEXIST);
+    }
+    CHECK(failures == 0);
+
+    MDBWriteBatch dels;
+    dels.del(main, 0);
+    dels.del(main, "not there");
+    CHECK(dels.size() == 2);
+    env.submit(std::move(dels)).get();
+
+    auto txn = env.getROTransaction();
+    MDBOutVal out;
+    CHECK(txn->get(main, "new", out) == MDB_NOTFOUND);
+    CHECK(txn->get(main, "taken", out) == 0);
+    CHECK(out.get<std::string>() == "already");
+    CHECK(txn->get(main, 0, out) == MDB_NOTFOUND);
+    for(int t = 0; t < 8; ++t) {
+      for(int n = 0; n < 100; ++n) {
+        if(t || n) {
+          REQUIRE(txn->get(main, t * 1000 + n, out) == 0);
+          CHECK(out.get<int>() == n);
+        }
+        REQUIRE(txn->get(main, t * 1000 + n + 500, out) == 0);
+      }
+    }
+  }
+  // submitting while holding the write lock would be a deadlock waiting to happen
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  auto txn = env.getRWTransaction();
+  CHECK_THROWS_AS(env.submit(MDBWriteBatch()), std::runtime_error);
+}
+
+TEST_CASE("commit durability levels", "[durability]")
+{
+  unlink("./tests");
+
+  auto ready = [](std::future<void>& f) {
+    return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  };
+
+  {
+    // LMDB syncs every commit here, so there is nothing left to wait for
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+    MDBDbi main = env.openDB("", MDB_CREATE);
+    auto txn = env.getRWTransaction();
+    txn->put(main, 1, 1);
+    auto f = txn->commit(MDBDurability::AsyncDurable);
+    CHECK(ready(f));
+  }
+
+  MDBEnv env("./tests", MDB_NOSUBDIR | MDB_NOSYNC, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+  env.setLazySyncInterval(std::chrono::milliseconds(10));
+
+  std::vector<std::thread> writers;
+  std::vector<int> results(12, -1);
+  for(int t = 0; t < 12; ++t) {
+    writers.emplace_back([&, t]() {
+        int bad = 0;
+        for(int n = 0; n < 50; ++n) {
+          auto txn = env.getRWTransaction();
+          txn->put(main, t * 100 + n, n);
+          auto durability = (MDBDurability)(t % 3);
+          auto f = txn->commit(durability);
+          // an async one may be ready already, if someone else synced meanwhile
+          if(durability != MDBDurability::AsyncDurable && !ready(f))
+            ++bad;
+          f.get();
+        }
+        results[t] = bad;
+      });
+  }
+  for(auto& w : writers)
+    w.join();
+  for(auto r : results)
+    CHECK(r == 0);
+
+  auto txn = env.getRWTransaction();
+  auto child = txn->getRWTransaction();
+  child->put(main, "nested", "child");
+  auto f = child->commit(MDBDurability::AsyncDurable);
+  CHECK(ready(f));
+  auto f2 = txn->commit(MDBDurability::AsyncDurable);
+  f2.get();
+
+  // a FireAndForget commit gets synced within the interval, also when nobody else waits for a sync
+  env.setLazySyncInterval(std::chrono::milliseconds(50));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  txn = env.getRWTransaction();
+  txn->put(main, "lazy", "yes");
+  size_t txnid = mdb_txn_id(*txn);
+  txn->commit(MDBDurability::FireAndForget);
+  CHECK(env.durableTxnid() < txnid);
+  auto start = std::chrono::steady_clock::now();
+  while(env.durableTxnid() < txnid && std::chrono::steady_clock::now() - start < std::chrono::seconds(2))
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  CHECK(env.durableTxnid() >= txnid);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+
+  auto rotxn = env.getROTransaction();
+  MDBOutVal out;
+  CHECK(rotxn->get(main, "nested", out) == 0);
+  CHECK(rotxn->get(main, 1149, out) == 0);
+}
+
+TEST_CASE("try_put and insert", "[tryput]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+  auto txn = env.getRWTransaction();
+
+  CHECK(txn->insert(main, "lmdb", "great") == 0);
+  MDBInVal val("again");
+  CHECK(txn->insert(main, "lmdb", val) == MDB_KEYEXIST);
+  CHECK(val.d_mdbval.mv_size == 5); // LMDB did not get to point it elsewhere
+  CHECK(txn->try_put(main, "lmdb", "fast") == 0);
+  CHECK_THROWS_AS(txn->put(main, "lmdb", "zooms", MDB_NOOVERWRITE), MDBException);
+
+  MDBOutVal out;
+  CHECK(txn->get(main, "lmdb", out) == 0);
+  CHECK(out.get<std::string>() == "fast");
+
+  // real errors still throw
+  CHECK_THROWS_AS(txn->try_put(main, "", "empty keys are invalid"), MDBException);
+
+  auto cursor = txn->getRWCursor(main);
+  CHECK(cursor.try_put("lmdb", "slow", MDB_NOOVERWRITE) == MDB_KEYEXIST);
+  CHECK(cursor.try_put("bdb", "old", MDB_NOOVERWRITE) == 0);
+  MDBOutVal key;
+  CHECK(cursor.find("mdb", key, out) == MDB_NOTFOUND);
+  CHECK(cursor.lower_bound("c", key, out) == 0);
+  CHECK(key.get<std::string>() == "lmdb");
+}
+
+// no padding, but the compiler can't vouch for the double, so it opts in
+struct Point { int32_t x, y; double weight; };
+template<> struct MDBIsPlain<Point> : std::true_type {};
+
+struct Padded { char c; int32_t i; };
+static_assert(!MDBIsPlain<Padded>::value, "padding bytes must not end up in the database");
+struct Unpadded { int32_t a, b; };
+static_assert(!LMDB_SAFE_NO_PADDING(Unpadded) || MDBIsPlain<Unpadded>::value, "plain structs are stored as they are");
+
+TEST_CASE("codec and ordered keys", "[codec]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+  auto txn = env.getRWTransaction();
+
+  std::vector<int64_t> numbers{-100000, -256, -1, 0, 1, 255, 256, 100000};
+  for(auto n : numbers)
+    txn->put(main, MDBOrdered<int64_t>(n), n);
+
+  auto cursor = txn->getCursor(main);
+  MDBOutVal key, val;
+  std::vector<int64_t> seen;
+  for(int rc = cursor.first(key, val); !rc; rc = cursor.next(key, val)) {
+    CHECK(key.get<MDBOrdered<int64_t>>() == val.get<int64_t>());
+    seen.push_back(key.get<MDBOrdered<int64_t>>());
+  }
+  CHECK(seen == numbers);
+
+  Point p{-3, 4, 0.5};
+  txn->put(main, "point", p);
+  REQUIRE(txn->get(main, "point", val) == 0);
+  auto q = val.get<Point>();
+  CHECK(q.x == -3);
+  CHECK(q.y == 4);
+  CHECK(q.weight == 0.5);
+  CHECK_THROWS_AS(val.get<int>(), std::runtime_error);
+
+  typedef std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> msec_t;
+  msec_t then(std::chrono::milliseconds(1500000000000)), later = then + std::chrono::milliseconds(1);
+  txn->put(main, MDBOrdered<msec_t>(later), "later");
+  txn->put(main, MDBOrdered<msec_t>(then), "then");
+  CHECK(cursor.lower_bound(MDBOrdered<msec_t>(then), key, val) == 0);
+  CHECK(val.get<std::string>() == "then");
+  CHECK(cursor.next(key, val) == 0);
+  CHECK(key.get<MDBOrdered<msec_t>>().d_value == later);
+
+  // a copy carries its own encoded bytes
+  std::vector<MDBInVal> vals;
+  for(int32_t n = 0; n < 10; ++n)
+    vals.push_back(MDBInVal(MDBOrdered<int32_t>(n)));
+  MDBInVal copy = vals[3];
+  vals.clear();
+  txn->put(main, "copied", copy);
+  REQUIRE(txn->get(main, "copied", val) == 0);
+  CHECK(val.get<MDBOrdered<int32_t>>() == 3);
+}
+
+TEST_CASE("reserved writes", "[reserve]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi main = env.openDB("", MDB_CREATE);
+  auto txn = env.getRWTransaction();
+
+  auto r = txn->reserve(main, "big", 5000);
+  REQUIRE(r.size() == 5000);
+  memset(r.data(), 'x', r.size());
+  txn->putReserved(main, "small", 3, [](char* data, size_t size) { memcpy(data, "abc", size); });
+  CHECK(!r.valid());
+  CHECK_THROWS_AS(r.data(), std::runtime_error);
+
+  auto r2 = txn->reserve(main, "cursor", 1);
+  {
+    auto cursor = txn->getRWCursor(main);
+    cursor.try_put("other", "value");
+  }
+  CHECK_THROWS_AS(r2.data(), std::runtime_error);
+
+  CHECK_THROWS_AS(txn->reserve(main, "big", 10, MDB_NOOVERWRITE), MDBException);
+  auto r3 = txn->reserve(main, "last", 4);
+  memcpy(r3.data(), "done", 4);
+  txn->commit();
+  CHECK_THROWS_AS(r3.data(), std::runtime_error);
+
+  auto rotxn = env.getROTransaction();
+  MDBOutVal out;
+  REQUIRE(rotxn->get(main, "big", out) == 0);
+  CHECK(out.get<std::string>() == std::string(5000, 'x'));
+  REQUIRE(rotxn->get(main, "small", out) == 0);
+  CHECK(out.get<std::string>() == "abc");
+  REQUIRE(rotxn->get(main, "last", out) == 0);
+  CHECK(out.get<std::string>() == "done");
+  rotxn->abort();
+
+  MDBDbi dups = env.openDB("dups", MDB_CREATE | MDB_DUPSORT);
+  auto txn2 = env.getRWTransaction();
+  CHECK_THROWS_AS(txn2->reserve(dups, "key", 10), std::runtime_error);
+}
+
+TEST_CASE("DUPFIXED pages", "[dupfixed]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dups = env.openDB("dups", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP);
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < 10000; ++n)
+      txn->put(dups, "many", n);
+    for(uint32_t n = 0; n < 5; ++n)
+      txn->put(dups, "few", n);
+    txn->commit();
+  }
+
+  auto txn = env.getROTransaction();
+  auto cursor = txn->getCursor(dups);
+
+  uint32_t expected = 0;
+  int pages = 0;
+  for(const auto& page : cursor.dupPages<uint32_t>("many")) {
+    ++pages;
+    for(auto n : page)
+      CHECK(n == expected++);
+  }
+  CHECK(expected == 10000);
+  CHECK(pages > 1);
+
+  int count = 0;
+  for(const auto& page : cursor.dupPages<uint32_t>("few"))
+    count += page.size();
+  CHECK(count == 5);
+
+  CHECK(cursor.dupPages<uint32_t>("none").begin() == cursor.dupPages<uint32_t>("none").end());
+  CHECK_THROWS_AS(cursor.dupPages<uint64_t>("many"), std::runtime_error);
+
+  // and by hand, from the start of the database
+  MDBOutVal key, val;
+  MDBSpan<const uint32_t> page;
+  size_t total = 0;
+  REQUIRE(cursor.first(key, val) == 0);
+  CHECK(key.get<std::string>() == "few");
+  for(int rc = cursor.getMultiple(page); !rc; rc = cursor.nextMultiple(key, page))
+    total += page.size();
+  CHECK(total == 5);
+}
+
+TEST_CASE("DUPFIXED multiple puts", "[dupfixed]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dups = env.openDB("dups", MDB_CREATE | MDB_DUPSORT | MDB_DUPFIXED | MDB_INTEGERDUP);
+  auto txn = env.getRWTransaction();
+
+  std::vector<uint32_t> ids;
+  for(uint32_t n = 0; n < 100000; ++n)
+    ids.push_back(n * 2);
+  CHECK(txn->putMultiple(dups, "even", ids) == ids.size());
+
+  // unsorted, with repeats, some of which are there already
+  std::vector<uint32_t> more{7, 3, 3, 4, 1, 7, 200001};
+  CHECK(txn->putMultiple(dups, "even", more, MDB_NODUPDATA, true) == 4);
+  CHECK(txn->putMultiple(dups, "even", MDBSpan<const uint32_t>(&more[3], 1), MDB_NODUPDATA) == 0);
+
+  {
+    auto cursor = txn->getRWCursor(dups);
+    uint32_t few[] = {5, 1, 9};
+    CHECK(cursor.putMultiple("few", MDBSpan<const uint32_t>(few, 3), 0, true) == 3);
+  }
+
+  auto cursor = txn->getCursor(dups);
+  std::vector<uint32_t> seen;
+  for(const auto& page : cursor.dupPages<uint32_t>("even"))
+    seen.insert(seen.end(), page.begin(), page.end());
+  CHECK(seen.size() == 100004);
+  CHECK(std::is_sorted(seen.begin(), seen.end()));
+  CHECK(seen[0] == 0);
+  CHECK(seen[1] == 1);
+  CHECK(seen.back() == 200001);
+
+  seen.clear();
+  for(const auto& page : cursor.dupPages<uint32_t>("few"))
+    seen.insert(seen.end(), page.begin(), page.end());
+  CHECK((seen == std::vector<uint32_t>{1, 5, 9}));
+
+  MDBDbi plain = txn->openDB("", 0);
+  CHECK_THROWS_AS(txn->putMultiple(plain, "nodups", ids), MDBException);
+}
+
+TEST_CASE("scan ranges", "[scan]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi strs = env.openDB("strings", MDB_CREATE);
+  MDBDbi ints = env.openDB("ints", MDB_CREATE | MDB_INTEGERKEY);
+  {
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 1000; ++n)
+      txn->put(ints, n, n);
+    for(auto s : {"a", "ab", "abc", "abd", "b", "ba", "c"})
+      txn->put(strs, s, std::string(s) + "!");
+    txn->commit();
+  }
+
+  auto txn = env.getROTransaction();
+  auto cursor = txn->getCursor(strs);
+  auto keys = [](MDBScanRange range) {
+    std::string ret;
+    for(const auto& kv : range) {
+      CHECK(std::string(kv.second.data(), kv.second.size()) == std::string(kv.first.data(), kv.first.size()) + "!");
+      ret += std::string(kv.first.data(), kv.first.size()) + " ";
+    }
+    return ret;
+  };
+
+  CHECK(keys(cursor.scan()) == "a ab abc abd b ba c ");
+  CHECK(keys(cursor.scan("ab", "b")) == "ab abc abd ");
+  CHECK(keys(cursor.scan("abb", "")) == "abc abd b ba c ");
+  CHECK(keys(cursor.scan("d", "e")) == "");
+  CHECK(keys(cursor.scanPrefix("ab")) == "ab abc abd ");
+  CHECK(keys(cursor.scanPrefix("b")) == "b ba ");
+  CHECK(keys(cursor.scanPrefix("x")) == "");
+  CHECK(keys(cursor.scanPrefix("")) == "a ab abc abd b ba c ");
+  CHECK(keys(cursor.scanReverse()) == "c ba b abd abc ab a ");
+  CHECK(keys(cursor.scanReverse("ab", "b")) == "abd abc ab ");
+  CHECK(keys(cursor.scanReverse("b", "zz")) == "c ba b ");
+  CHECK(keys(cursor.scanReverse("", "a")) == "");
+
+  auto icursor = txn->getCursor(ints);
+  unsigned int lo = 255, hi = 260, count = 0;
+  for(const auto& kv : icursor.scan(string_view((char*)&lo, sizeof(lo)), string_view((char*)&hi, sizeof(hi)))) {
+    unsigned int n;
+    memcpy(&n, kv.first.data(), sizeof(n));
+    CHECK(n == lo + count++);
+  }
+  CHECK(count == 5);
+  CHECK_THROWS_AS(icursor.scanPrefix(string_view((char*)&lo, 1)).begin(), std::runtime_error);
+}
+
+// sorts keys backwards, byte for byte
+static int reverseBytes(const MDB_val* a, const MDB_val* b)
+{
+  int rc = memcmp(b->mv_data, a->mv_data, std::min(a->mv_size, b->mv_size));
+  if(rc)
+    return rc;
+  return a->mv_size < b->mv_size ? 1 : (a->mv_size > b->mv_size ? -1 : 0);
+}
+
+TEST_CASE("scan ranges with a custom comparator", "[scan]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dbi = env.openDB("backwards", MDB_CREATE);
+  auto txn = env.getRWTransaction();
+  REQUIRE(mdb_set_compare(*txn, dbi, reverseBytes) == 0);
+  for(auto s : {"a", "b", "c", "d"})
+    txn->put(dbi, s, s);
+
+  auto cursor = txn->getCursor(dbi);
+  auto keys = [](MDBScanRange range) {
+    std::string ret;
+    for(const auto& kv : range)
+      ret += std::string(kv.first.data(), kv.first.size()) + " ";
+    return ret;
+  };
+  CHECK(keys(cursor.scan()) == "d c b a ");
+  CHECK(keys(cursor.scan("c", "a")) == "c b ");
+  CHECK(keys(cursor.scanReverse("c", "a")) == "b c ");
+  CHECK(keys(cursor.scan("b", "")) == "b a ");
+}
+
+TEST_CASE("scan batches", "[scan]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi ints = env.openDB("ints", MDB_CREATE | MDB_INTEGERKEY);
+  {
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 1000; ++n)
+      txn->put(ints, n, n * 2);
+    txn->commit();
+  }
+
+  auto txn = env.getROTransaction();
+  auto cursor = txn->getCursor(ints);
+  string_view keys[64], vals[64];
+  unsigned int expected = 0;
+  while(size_t count = cursor.scanBatch(64, keys, vals)) {
+    CHECK((count == 64 || expected + count == 1000));
+    for(size_t n = 0; n < count; ++n, ++expected) {
+      unsigned int k, v;
+      memcpy(&k, keys[n].data(), sizeof(k));
+      memcpy(&v, vals[n].data(), sizeof(v));
+      CHECK(k == expected);
+      CHECK(v == expected * 2);
+    }
+  }
+  CHECK(expected == 1000);
+  CHECK(cursor.scanBatch(64, keys, vals) == 0);
+
+  // backwards from where a lookup left us, keys only
+  MDBOutVal key, val;
+  REQUIRE(cursor.lower_bound(10u, key, val) == 0);
+  CHECK(cursor.scanBatch(64, keys, nullptr, MDB_PREV) == 10);
+}
+
+TEST_CASE("parallel scans", "[parallelscan]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi strs = env.openDB("strings", MDB_CREATE);
+  MDBDbi ints = env.openDB("ints", MDB_CREATE | MDB_INTEGERKEY);
+  {
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < 100000; ++n) {
+      txn->put(strs, MDBOrdered<uint32_t>(n * 7), n);
+      txn->put(ints, n * n, n);
+    }
+    txn->commit();
+  }
+
+  // a writer that keeps going while we scan, which our snapshot should not notice
+  std::atomic<bool> stop{false};
+  std::thread writer([&]() {
+      for(uint32_t n = 1; !stop; ++n) {
+        auto txn = env.getRWTransaction();
+        txn->put(strs, MDBOrdered<uint32_t>(n * 7 + 1), n);
+        txn->commit();
+      }
+    });
+
+  for(auto dbi : {strs, ints}) {
+    std::mutex mut;
+    std::vector<std::pair<std::string, std::string>> ranges;
+    std::set<size_t> txnids;
+    std::set<unsigned int> workers;
+    std::atomic<size_t> count{0};
+    env.parallelScan(dbi, 4, [&](unsigned int worker, MDBROCursor& cursor, string_view lo, string_view hi) {
+        size_t mine = 0;
+        for(const auto& kv : cursor.scan(lo, hi)) {
+          (void)kv;
+          ++mine;
+        }
+        count += mine;
+        std::lock_guard<std::mutex> l(mut);
+        ranges.emplace_back(std::string(lo.data(), lo.size()), std::string(hi.data(), hi.size()));
+        txnids.insert(mdb_txn_id(mdb_cursor_txn(cursor)));
+        workers.insert(worker);
+      });
+    CHECK(txnids.size() == 1);
+    CHECK(*workers.rbegin() < 4);
+    if(dbi == ints)
+      CHECK(count == 100000);
+    else
+      CHECK(count >= 100000);
+    CHECK(ranges.size() > 4);
+    // the ranges fit together, without gaps or overlap
+    std::map<std::string, std::string> chain(ranges.begin(), ranges.end());
+    CHECK(chain.size() == ranges.size());
+    std::string edge;
+    size_t links = 0;
+    do {
+      REQUIRE(chain.count(edge));
+      edge = chain[edge];
+      ++links;
+    } while(!edge.empty());
+    CHECK(links == ranges.size());
+  }
+  stop = true;
+  writer.join();
+
+  CHECK_THROWS_AS(env.parallelScan(strs, 4, [](unsigned int, MDBROCursor&, string_view, string_view) {
+        throw std::runtime_error("stop");
+      }), std::runtime_error);
+
+  auto txn = env.getROTransaction();
+  CHECK_THROWS_AS(env.parallelScan(strs, 4, [](unsigned int, MDBROCursor&, string_view, string_view) {}),
+                  std::runtime_error);
+}
+
+TEST_CASE("parallel scans, read-only", "[parallelscan]")
+{
+  unlink("./tests");
+  {
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+    MDBDbi dbi = env.openDB("", MDB_CREATE);
+    auto txn = env.getRWTransaction();
+    for(uint32_t n = 0; n < 10000; ++n)
+      txn->put(dbi, MDBOrdered<uint32_t>(n), n);
+    txn->commit();
+  }
+
+  MDBEnv env("./tests", MDB_NOSUBDIR | MDB_RDONLY, 0600);
+  MDBDbi dbi = env.openDB("", 0);
+  std::mutex mut;
+  std::set<size_t> txnids;
+  std::atomic<size_t> count{0};
+  env.parallelScan(dbi, 4, [&](unsigned int, MDBROCursor& cursor, string_view lo, string_view hi) {
+      for(const auto& kv : cursor.scan(lo, hi)) {
+        (void)kv;
+        ++count;
+      }
+      std::lock_guard<std::mutex> l(mut);
+      txnids.insert(mdb_txn_id(mdb_cursor_txn(cursor)));
+    });
+  CHECK(count == 10000);
+  CHECK(txnids.size() == 1);
+}
+
+TEST_CASE("multi-get", "[getmany]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi strs = env.openDB("strings", MDB_CREATE);
+  MDBDbi dups = env.openDB("dups", MDB_CREATE | MDB_DUPSORT);
+  {
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 1000; n += 2) {
+      std::string key = "k" + std::to_string(1000 + n);
+      txn->put(strs, key, key + "!");
+    }
+    txn->put(dups, "a", "2");
+    txn->put(dups, "a", "1");
+    txn->put(dups, "b", "3");
+    txn->commit();
+  }
+
+  // hits, misses, repeats, before the first and after the last key, in no order
+  std::vector<std::string> wanted{"k1500", "k1002", "k1003", "a", "k1998", "k1002", "k1000", "z", "k1999", "k1004"};
+  for(unsigned int n = 1100; n < 1200; n += 3)
+    wanted.push_back("k" + std::to_string(n));
+  std::vector<string_view> keys(wanted.begin(), wanted.end()), vals;
+
+  auto txn = env.getROTransaction();
+  size_t expected = 0;
+  auto check = [&]() {
+    REQUIRE(vals.size() == keys.size());
+    for(size_t n = 0; n < keys.size(); ++n) {
+      string_view val;
+      if(txn->get(strs, keys[n], val)) {
+        CHECK(vals[n].data() == nullptr);
+      }
+      else {
+        CHECK(vals[n] == val);
+      }
+    }
+  };
+  for(size_t n = 0; n < keys.size(); ++n) {
+    string_view val;
+    if(!txn->get(strs, keys[n], val))
+      ++expected;
+  }
+  CHECK(txn->getMany(strs, keys, vals) == expected);
+  check();
+
+  std::sort(keys.begin(), keys.end());
+  CHECK(txn->getMany(strs, keys, vals, true) == expected);
+  check();
+
+  // like get(), this gives the first duplicate
+  std::vector<string_view> dkeys{"b", "a", "c"};
+  CHECK(txn->getMany(dups, dkeys, vals) == 2);
+  CHECK(vals[0] == "3");
+  CHECK(vals[1] == "1");
+  CHECK(vals[2].data() == nullptr);
+}
+
+TEST_CASE("warm-up", "[warmup]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi small = env.openDB("small", MDB_CREATE);
+  MDBDbi large = env.openDB("large", MDB_CREATE);
+  {
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 20000; ++n)
+      txn->put(small, MDBOrdered<uint32_t>(n), n);
+    for(unsigned int n = 0; n < 100; ++n)
+      txn->put(large, MDBOrdered<uint32_t>(n), std::string(20000, 'x'));
+    txn->commit();
+  }
+
+  // progress is called one at a time, but from other threads
+  std::vector<std::pair<size_t, size_t>> reports;
+  auto progress = [&reports](size_t done, size_t total) { reports.emplace_back(done, total); };
+
+  size_t all = env.warmup(std::numeric_limits<size_t>::max(), 4, progress);
+  CHECK(all > 2 * 1000 * 1000);
+  REQUIRE(!reports.empty());
+  CHECK(reports.back() == std::make_pair(all, all));
+  for(size_t n = 1; n < reports.size(); ++n)
+    CHECK(reports[n].first > reports[n-1].first);
+
+  CHECK(env.warmup(65536, 2) == 65536);
+
+  MDB_stat st;
+  {
+    auto txn = env.getROTransaction();
+    mdb_stat(*txn, large, &st);
+  }
+  reports.clear();
+  size_t bytes = env.warmup(large, std::numeric_limits<size_t>::max(), 4, progress);
+  CHECK(bytes == (st.ms_branch_pages + st.ms_leaf_pages + st.ms_overflow_pages) * st.ms_psize);
+  REQUIRE(!reports.empty());
+  CHECK(reports.back().first == bytes);
+
+  CHECK(env.warmup(small, 16384, 4) == 16384);
+}
+
+TEST_CASE("hot pages", "[warmup]")
+{
+  unlink("./tests");
+  unlink("./tests-hot");
+  {
+    MDBEnvOptions options;
+    options.d_hotPageFile = "./tests-hot";
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+    MDBDbi dbi = env.openDB("", MDB_CREATE);
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 20000; ++n)
+      txn->put(dbi, MDBOrdered<uint32_t>(n), n);
+    txn->commit();
+  }
+  // saved when the environment closed
+  std::ifstream saved("./tests-hot", std::ios::binary | std::ios::ate);
+  REQUIRE(saved);
+  CHECK(saved.tellg() > 24);
+
+  {
+    // and restored in the background when it opens again
+    MDBEnvOptions options;
+    options.d_hotPageFile = "./tests-hot";
+    options.d_hotPageThreads = 2;
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+    CHECK(env.waitForHotPages() > 0);
+    CHECK(env.waitForHotPages() == 0);
+  }
+  {
+    // closing right away does not wait for all of it
+    MDBEnvOptions options;
+    options.d_hotPageFile = "./tests-hot";
+    MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+  }
+
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  CHECK(env.waitForHotPages() == 0);
+  CHECK(env.restoreHotPages("./tests-nosuchfile") == 0);
+
+  // we just wrote all of it, so all of it is in memory
+  env.warmup();
+  env.saveHotPages("./tests-hot");
+  std::vector<std::pair<size_t, size_t>> reports;
+  size_t bytes = env.restoreHotPages("./tests-hot", 4, [&reports](size_t done, size_t total) { reports.emplace_back(done, total); });
+  CHECK(bytes > 0);
+  REQUIRE(!reports.empty());
+  CHECK(reports.back() == std::make_pair(bytes, bytes));
+
+  {
+    std::ofstream out("./tests-hot", std::ios::trunc);
+    out << "not a bitmap, but long enough for a header";
+  }
+  CHECK_THROWS_AS(env.restoreHotPages("./tests-hot"), std::runtime_error);
+  unlink("./tests-hot");
+}
+
+TEST_CASE("metrics", "[metrics]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dbi = env.openDB("", MDB_CREATE);
+  // openDB has a RW transaction of its own, which counts too
+  auto before = env.metrics();
+  {
+    auto txn = env.getRWTransaction();
+    for(unsigned int n = 0; n < 100; ++n)
+      txn->put(dbi, n, n);
+    txn->del(dbi, 0U);
+    txn->commit();
+  }
+  {
+    auto txn = env.getROTransaction();
+    MDBOutVal val;
+    for(unsigned int n = 0; n < 200; ++n)
+      txn->get(dbi, n, val);
+    auto cursor = txn->getCursor(dbi);
+    MDBOutVal key;
+    for(int rc = cursor.first(key, val); !rc; rc = cursor.next(key, val))
+      ;
+    // scans step the cursor too
+    for(const auto& kv : cursor.scan())
+      (void)kv;
+    string_view keys[256];
+    auto batch = txn->getCursor(dbi);
+    CHECK(batch.scanBatch(256, keys, nullptr) == 99);
+  }
+
+  auto m = env.metrics();
+  auto count = [&](MDBOp op) { return m[op].d_count - before[op].d_count; };
+  auto notfound = [&](MDBOp op) { return m[op].d_notfound - before[op].d_notfound; };
+#if LMDB_SAFE_METRICS
+  CHECK(count(MDBOp::Put) == 100);
+  CHECK(m[MDBOp::Put].d_bytes - before[MDBOp::Put].d_bytes == 800);
+  CHECK(count(MDBOp::Del) == 1);
+  CHECK(count(MDBOp::Get) == 200);
+  CHECK(notfound(MDBOp::Get) == 101);
+  CHECK(m[MDBOp::Get].d_bytes - before[MDBOp::Get].d_bytes == 99 * 4);
+  // 99 rows and an MDB_NOTFOUND, for next(), scan() and scanBatch() alike
+  CHECK(count(MDBOp::Cursor) == 300);
+  CHECK(notfound(MDBOp::Cursor) == 3);
+  CHECK(before[MDBOp::BeginRW].d_count == 1);
+  CHECK(count(MDBOp::BeginRW) == 1);
+  CHECK(count(MDBOp::Commit) == 1);
+  CHECK(count(MDBOp::BeginRO) >= 1);
+
+  // one in s_sampleEvery is timed
+  CHECK(m[MDBOp::Get].timed() > 0);
+  CHECK(m[MDBOp::Get].timed() <= 200);
+  CHECK(m[MDBOp::Get].percentile(0.5) <= m[MDBOp::Get].percentile(0.99));
+  CHECK(m[MDBOp::Get].percentile(0.99) > 0);
+#else
+  (void)count;
+  (void)notfound;
+  for(int op = 0; op < (int)MDBOp::Max; ++op) {
+    CHECK(m.d_ops[op].d_count == 0);
+    CHECK(m.d_ops[op].timed() == 0);
+  }
+#endif
+}
+
+TEST_CASE("writer profiling", "[writerprofile]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dbi = env.openDB("", MDB_CREATE);
+
+  {
+    auto txn = env.getRWTransaction("not profiled");
+    txn->commit();
+  }
+  env.setWriterProfiling(true);
+  {
+    auto txn = env.getRWTransaction("slow");
+    txn->put(dbi, "a", "b");
+    // meanwhile, another thread waits for the write lock
+    std::thread waiter([&env, &dbi]() {
+        auto txn = env.getRWTransaction("waiter");
+        txn->put(dbi, "c", "d");
+        txn->commit();
+      });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    txn->commit();
+    waiter.join();
+  }
+  for(int n = 0; n < 3; ++n) {
+    auto txn = env.getRWTransaction("fast");
+    txn->put(dbi, "e", "f");
+    if(n)
+      txn->commit();
+    // the first one aborts
+  }
+  {
+    auto txn = env.getRWTransaction();
+    txn->commit();
+  }
+
+  auto profile = env.writerProfile();
+  REQUIRE(profile.size() == 4);
+  CHECK(profile[0].d_site == "slow");
+  CHECK(profile[0].d_count == 1);
+  CHECK(profile[0].d_hold >= std::chrono::milliseconds(50));
+  CHECK(profile[0].d_maxHold >= std::chrono::milliseconds(50));
+  for(size_t n = 1; n < profile.size(); ++n)
+    CHECK(profile[n-1].locked() >= profile[n].locked());
+
+  std::map<std::string, MDBWriterSite> sites;
+  for(const auto& p : profile)
+    sites[p.d_site] = p;
+  CHECK(sites.count("not profiled") == 0);
+  CHECK(sites["waiter"].d_wait >= std::chrono::milliseconds(30));
+  CHECK(sites["fast"].d_count == 3);
+  CHECK(sites["fast"].d_aborts == 1);
+  CHECK(sites["(unknown)"].d_count == 1);
+
+  CHECK(env.writerProfile(1).size() == 1);
+
+  env.setWriterProfiling(false);
+  {
+    auto txn = env.getRWTransaction("off");
+    txn->commit();
+  }
+  CHECK(env.writerProfile().size() == 4);
+  env.setWriterProfiling(true);
+  CHECK(env.writerProfile().empty());
+}
+
+TEST_CASE("reader watchdog", "[readers]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  MDBDbi dbi = env.openDB("", MDB_CREATE);
+
+  std::mutex mut;
+  std::vector<MDBLongReader> reports;
+  MDBReaderWatchdogOptions options;
+  options.d_interval = std::chrono::milliseconds(10);
+  options.d_threshold = std::chrono::milliseconds(100);
+  options.d_hook = [&](const MDBLongReader& r) {
+    std::lock_guard<std::mutex> l(mut);
+    reports.push_back(r);
+  };
+  env.startReaderWatchdog(options);
+
+  // a thread can not write while it has a RO transaction open, so another thread forgets one
+  std::atomic<size_t> forgottenId{0};
+  std::atomic<bool> release{false};
+  std::thread forgetter([&]() {
+      auto forgotten = env.getROTransaction("forgotten");
+      forgottenId = mdb_txn_id(*forgotten);
+      while(!release)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+  while(!forgottenId)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  for(int n = 0; n < 3; ++n) {
+    auto txn = env.getRWTransaction();
+    txn->put(dbi, n, n);
+    txn->commit();
+  }
+  for(int n = 0; n < 20; ++n) {
+    auto txn = env.getPooledROTransaction("short");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  {
+    std::lock_guard<std::mutex> l(mut);
+    REQUIRE(reports.size() == 1); // and only once
+    CHECK(std::string(reports[0].d_site) == "forgotten");
+    CHECK(reports[0].d_age >= std::chrono::milliseconds(100));
+    CHECK(reports[0].d_txnid == forgottenId);
+  }
+
+  auto stats = env.readerStats();
+  CHECK(stats.d_maxReaders > 0);
+  CHECK(stats.d_slotsUsed >= 1);
+  CHECK(stats.d_oldestReader == forgottenId);
+  CHECK(stats.d_lastTxnid == forgottenId + 3);
+  CHECK(stats.lag() == 3);
+
+  release = true;
+  forgetter.join();
+  CHECK(env.readerStats().lag() == 0);
+
+  // a process that dies with a transaction open leaves its reader slot behind.
+  // Only the forking thread lives on in the child, so no watchdog thread while we fork
+  env.stopReaderWatchdog();
+  pid_t pid = fork();
+  if(!pid) {
+    MDBEnv child("./tests", MDB_NOSUBDIR, 0600);
+    auto txn = child.getROTransaction();
+    _exit(0);
+  }
+  REQUIRE(pid > 0);
+  int status;
+  waitpid(pid, &status, 0);
+  env.startReaderWatchdog(options);
+  for(int n = 0; n < 100 && !env.readerStats().d_staleCleared; ++n)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  CHECK(env.readerStats().d_staleCleared == 1);
+
+  env.stopReaderWatchdog();
+}
+
+TEST_CASE("reader slot admission", "[readers]")
+{
+  unlink("./tests");
+  MDBEnvOptions options;
+  options.d_maxreaders = 4;
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600, options);
+  env.openDB("", MDB_CREATE);
+
+  // a pooled transaction that went idle keeps its slot
+  env.getPooledROTransaction();
+
+  std::vector<MDBROTransaction> txns;
+  for(int n = 0; n < 3; ++n)
+    txns.push_back(env.getROTransaction());
+  auto stats = env.readerStats();
+  CHECK(stats.d_maxReaders == 4);
+  CHECK(stats.d_slotsUsed == 4);
+  CHECK(stats.d_slotsOurs == 4);
+
+  // the idle one gets closed to make room
+  txns.push_back(env.getROTransaction());
+  CHECK(env.readerStats().d_slotWaits == 1);
+
+  // with nobody making room, we give up
+  env.setReaderSlotTimeout(std::chrono::milliseconds(0));
+  try {
+    env.getROTransaction();
+    FAIL("got a fifth reader slot");
+  }
+  catch(const MDBException& e) {
+    CHECK(e.getRC() == MDB_READERS_FULL);
+  }
+  env.setReaderSlotTimeout(std::chrono::milliseconds(50));
+  CHECK_THROWS_AS(env.getROTransaction(), MDBException);
+  CHECK(env.readerStats().d_slotTimeouts == 2);
+
+  // or wait for one to close
+  env.setReaderSlotTimeout(std::chrono::milliseconds(5000));
+  std::thread closer([&txns]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      txns.pop_back();
+    });
+  auto start = std::chrono::steady_clock::now();
+  auto txn = env.getROTransaction();
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(40));
+  closer.join();
+  stats = env.readerStats();
+  CHECK(stats.d_slotWaits == 3);
+  CHECK(stats.d_slotTimeouts == 2);
+  CHECK(stats.d_waiting == 0);
+}
+
+TEST_CASE("shared snapshots", "[snapshot]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("snapshots", MDB_CREATE);
+
+  auto txn = env.getRWTransaction();
+  for(unsigned int n = 0; n < 1000; ++n)
+    txn->put(dbi, n, "old");
+  txn->commit();
+
+  auto snap = env.getSnapshot();
+  CHECK(snap);
+  CHECK(env.readerStats().d_slotsOurs == 1);
+
+  txn = env.getRWTransaction();
+  for(unsigned int n = 0; n < 1000; ++n)
+    txn->put(dbi, n, "new");
+  txn->put(dbi, 1000U, "new");
+  txn->commit();
+
+  // a fresh snapshot, taken before any thread touched the database
+  auto fresh = env.getSnapshot();
+  CHECK(fresh.id() > snap.id());
+
+  std::atomic<unsigned int> olds{0}, news{0}, rows{0};
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t]() {
+        MDBSnapshot mine = t % 2 ? snap : fresh;
+        for(unsigned int n = 0; n < 1001; ++n) {
+          string_view val;
+          if(!mine.get(dbi, n, val))
+            (val == "old" ? olds : news)++;
+        }
+        auto cursor = mine.getCursor(dbi);
+        MDBOutVal key, val;
+        for(int rc = cursor.first(key, val); !rc; rc = cursor.next(key, val))
+          rows++;
+      });
+  }
+  for(auto& t : threads)
+    t.join();
+  CHECK(olds == 2 * 1000);
+  CHECK(news == 2 * 1001);
+  CHECK(rows == 2 * 1000 + 2 * 1001);
+  CHECK(env.readerStats().d_slotsOurs == 2);
+
+  // a cursor keeps its snapshot open
+  auto cursor = fresh.getCursor(dbi);
+  fresh = MDBSnapshot();
+  MDBOutVal key, val;
+  CHECK(cursor.find(1000U, key, val) == 0);
+  CHECK(val.get<string_view>() == "new");
+  cursor.close();
+  snap = MDBSnapshot();
+  CHECK(env.readerStats().d_slotsOurs == 0);
+
+  // shared snapshots are reused until something gets committed
+  auto shared = env.getSharedSnapshot();
+  CHECK(env.getSharedSnapshot().id() == shared.id());
+  CHECK(env.readerStats().d_slotsOurs == 1);
+  txn = env.getRWTransaction();
+  txn->put(dbi, 1001U, "new");
+  txn->commit();
+  auto newer = env.getSharedSnapshot();
+  CHECK(newer.id() > shared.id());
+  CHECK(env.getSharedSnapshot().id() == newer.id());
+  string_view out;
+  CHECK(shared.get(dbi, 1001U, out) == MDB_NOTFOUND);
+  CHECK(newer.get(dbi, 1001U, out) == 0);
+}
+
+TEST_CASE("value transactions", "[valuetxn]")
+{
+  unlink("./tests");
+  MDBEnv env("./tests", MDB_NOSUBDIR, 0600);
+  auto dbi = env.openDB("", MDB_CREATE);
+
+  {
+    auto txn = env.beginRW();
+    txn.put(dbi, "a", "1");
+
+    auto child = txn.beginRW();
+    child.put(dbi, "b", "2");
+    child.abort();
+    child = txn.beginRW();
+    child.put(dbi, "c", "3");
+    child.commit();
+
+    // moving takes the cursors along, but not the reservations
+    auto cursor = txn.getCursor(dbi);
+    auto reservation = txn.reserve(dbi, "d", 1);
+    MDBRWTransactionImpl moved(std::move(txn));
+    CHECK(!txn);
+    CHECK_THROWS_AS(reservation.data(), std::runtime_error);
+    MDBOutVal key, val;
+    CHECK(cursor.find("c", key, val) == 0);
+
+    // that would lose the RW half
+    CHECK_THROWS_AS(MDBROTransactionImpl(std::move(moved)), std::runtime_error);
+    CHECK(moved);
+    moved.commit();
+  }
+
+  auto txn = env.beginRO();
+  string_view val;
+  CHECK(txn.get(dbi, "a", val) == 0);
+  CHECK(txn.get(dbi, "b", val) == MDB_NOTFOUND);
+  CHECK(txn.get(dbi, "c", val) == 0);
+
+  auto cursor = txn.getCursor(dbi);
+  MDBROTransactionImpl moved(std::move(txn));
+  MDBOutVal key, data;
+  CHECK(cursor.first(key, data) == 0);
+  CHECK(key.get<string_view>() == "a");
+  moved = env.beginPooledRO();
+  CHECK(moved.get(dbi, "c", val) == 0);
+  moved.commit();
+
+  // through a RO pointer, a RW transaction still commits as one
+  {
+    auto rw = env.getRWTransaction();
+    MDBROTransaction child = rw->getROTransaction();
+    static_cast<MDBRWTransactionImpl&>(*child).put(dbi, "e", "5");
+    child->commit();
+    rw->commit();
+  }
+  CHECK(env.beginRO().get(dbi, "e", val) == 0);
+}